@@ -2,6 +2,8 @@
 #include "binary.h"
 #include "find.h"
 #include <stddef.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 static inline bool prange_check(const struct binary *binary, prange_t range);
 
@@ -9,25 +11,355 @@ void b_init(struct binary *binary) {
     memset(binary, 0, sizeof(*binary));
 }
 
+#define ARENA_CHUNK 0x10000
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used, size;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct arena_mapping {
+    struct arena_mapping *next;
+    prange_t range;
+};
+
+struct data_arena {
+    // lazy builds can allocate from a shared binary, so everything below is under this
+    pthread_mutex_t lock;
+    // allocations are bumped out of the first chunk
+    struct arena_chunk *chunks;
+    struct arena_mapping *mappings;
+};
+
+static struct arena_chunk *arena_chunk_new(size_t size) {
+    struct arena_chunk *chunk = calloc(1, sizeof(*chunk) + size);
+    if(chunk) {
+        chunk->size = size;
+    }
+    return chunk;
+}
+
+// the first allocation makes the arena; threads racing to do that on a shared binary publish theirs
+// the way b_lazy_set does, and the losers throw theirs away
+static struct data_arena *get_arena(const struct binary *binary) {
+    struct data_arena *arena = b_lazy_get(binary->arena);
+    if(arena) {
+        return arena;
+    }
+    if(!(arena = calloc(1, sizeof(*arena)))) {
+        return NULL;
+    }
+    pthread_mutex_init(&arena->lock, NULL);
+    struct data_arena *old = data_atomic_cas(&((struct binary *) binary)->arena, NULL, arena);
+    if(old) {
+        pthread_mutex_destroy(&arena->lock);
+        free(arena);
+        return old;
+    }
+    return arena;
+}
+
+// call with arena->lock held
+static void *arena_alloc(struct data_arena *arena, size_t size) {
+    struct arena_chunk *chunk = arena->chunks;
+    if(chunk && chunk->size - chunk->used >= size) {
+        void *ret = chunk->data + chunk->used;
+        chunk->used += size;
+        return ret;
+    }
+    if(size > ARENA_CHUNK / 4) {
+        // big ones get their own chunk, which goes behind the current one
+        struct arena_chunk *big = arena_chunk_new(size);
+        if(!big) return NULL;
+        big->used = size;
+        if(chunk) {
+            big->next = chunk->next;
+            chunk->next = big;
+        } else {
+            arena->chunks = big;
+        }
+        return big->data;
+    }
+    if(!(chunk = arena_chunk_new(ARENA_CHUNK))) {
+        return NULL;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    chunk->used = size;
+    return chunk->data;
+}
+
+void *b_alloc(const struct binary *binary, size_t size) {
+    if(size > SIZE_MAX - 15) {
+        die("out of memory (%zu)", size);
+    }
+    struct data_arena *arena = get_arena(binary);
+    void *ret = NULL;
+    if(arena) {
+        pthread_mutex_lock(&arena->lock);
+        ret = arena_alloc(arena, (size + 15) & ~(size_t) 15);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    if(!ret) {
+        die("out of memory (%zu)", size);
+    }
+    return ret;
+}
+
+void b_own_mapping(const struct binary *binary, prange_t range) {
+    struct arena_mapping *m = b_alloc(binary, sizeof(*m));
+    m->range = range;
+    struct data_arena *arena = binary->arena;
+    pthread_mutex_lock(&arena->lock);
+    m->next = arena->mappings;
+    arena->mappings = m;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void close_windows(struct data_windows *windows);
+
+void b_destroy(struct binary *binary) {
+    b_journal_stop(binary);
+    if(binary->windows) {
+        close_windows(binary->windows);
+    }
+    for(unsigned int i = 0; i < binary->nreexports; i++) {
+        b_destroy(&binary->reexports[i]);
+    }
+    struct data_arena *arena = binary->arena;
+    if(arena) {
+        for(struct arena_mapping *m = arena->mappings; m; m = m->next) {
+            punmap(m->range);
+        }
+        for(struct arena_chunk *chunk = arena->chunks, *next; chunk; chunk = next) {
+            next = chunk->next;
+            free(chunk);
+        }
+        pthread_mutex_destroy(&arena->lock);
+        free(arena);
+    }
+    b_init(binary);
+}
+
+static int segment_key_cmp(const void *a, const void *b) {
+    addr_t x = ((const struct data_segment_key *) a)->start, y = ((const struct data_segment_key *) b)->start;
+    return x < y ? -1 : x > y;
+}
+
+static struct data_segment_key *index_segments(const struct binary *binary, bool is_off, uint32_t *nkeys) {
+    struct data_segment_key *keys = b_alloc(binary, sizeof(*keys) * (binary->nsegments ? binary->nsegments : 1)), *key = keys;
+    for(uint32_t i = 0; i < binary->nsegments; i++) {
+        const struct data_segment *seg = &binary->segments[i];
+        if(!seg->file_range.size) continue;
+        key->start = (is_off ? seg->file_range : seg->vm_range).start;
+        key->size = seg->file_range.size;
+        key->seg = i;
+        key++;
+    }
+    *nkeys = key - keys;
+    qsort(keys, *nkeys, sizeof(*keys), segment_key_cmp);
+    for(uint32_t i = 1; i < *nkeys; i++) {
+        if(keys[i].start - keys[i - 1].start < keys[i - 1].size) {
+            // overlapping segments; the first one in load command order wins, so fall back to scanning
+            *nkeys = 0;
+            return NULL;
+        }
+    }
+    return keys;
+}
+
+void b_index_segments(struct binary *binary) {
+    // any old indices stay in the arena
+    binary->vm_index = index_segments(binary, false, &binary->nvm_index);
+    binary->file_index = index_segments(binary, true, &binary->nfile_index);
+}
+
+// the segment the last lookup on this thread hit; it's only a hint, so it doesn't matter if the binary is gone
+struct seg_hint {
+    const struct binary *binary;
+    uint32_t seg;
+};
+DATA_THREAD_LOCAL(struct seg_hint, seg_hint)
+
 static inline bool rangeconv_stuff(const struct binary *binary, addr_t addr, bool is_off, addr_t *out_address, addr_t *out_offset, size_t *out_size) {
-    uint32_t ls = binary->last_seg, ns = binary->nsegments, i = ls;
+    struct seg_hint *hint = seg_hint();
+    uint32_t ns = binary->nsegments, i = hint->binary == binary ? hint->seg : ns;
     #define STUFF \
         const struct data_segment *seg = &binary->segments[i]; \
         addr_t diff = addr - (is_off ? seg->file_range : seg->vm_range).start; \
         if(diff < seg->file_range.size) { \
-            ((struct binary *) binary)->last_seg = i; \
+            hint->binary = binary; \
+            hint->seg = i; \
             *out_address = seg->vm_range.start + diff; \
             *out_offset = seg->file_range.start + diff; \
             *out_size = seg->file_range.size - diff; \
             return true; \
         }
-    STUFF
+    if(i < ns) {
+        STUFF
+    }
+    const struct data_segment_key *keys = is_off ? binary->file_index : binary->vm_index;
+    if(keys) {
+        // find the last key with start <= addr
+        uint32_t n = is_off ? binary->nfile_index : binary->nvm_index;
+        if(!n) return false;
+        while(n > 1) {
+            uint32_t half = n / 2;
+            keys = keys[half].start <= addr ? keys + half : keys;
+            n -= half;
+        }
+        if(addr - keys->start >= keys->size) return false;
+        i = keys->seg;
+        STUFF
+    }
     for(i = 0; i < ns; i++) {
         STUFF
     }
+    #undef STUFF
     return false;
 }
 
+// windows are at least this big, and start on a multiple of it
+#define WINDOW_SIZE 0x400000
+
+struct data_window {
+    struct data_window *prev, *next;
+    uint64_t offset;
+    size_t size;
+    char *ptr;
+    unsigned int pins;
+};
+
+struct data_windows {
+    pthread_mutex_t lock;
+    int fd;
+    uint64_t file_size;
+    size_t budget, mapped;
+    // most recently used first
+    struct data_window *head, *tail;
+};
+
+void b_open_windows(struct binary *binary, int fd, size_t budget) {
+    struct stat st;
+    if(fstat(fd, &st)) {
+        edie("could not stat");
+    }
+    struct data_windows *windows = b_alloc(binary, sizeof(*windows));
+    if((windows->fd = dup(fd)) == -1) {
+        edie("could not dup");
+    }
+    pthread_mutex_init(&windows->lock, NULL);
+    windows->file_size = (uint64_t) st.st_size;
+    windows->budget = max(budget, (size_t) WINDOW_SIZE);
+    binary->windows = windows;
+}
+
+static void close_windows(struct data_windows *windows) {
+    for(struct data_window *window = windows->head, *next; window; window = next) {
+        next = window->next;
+        munmap(window->ptr, window->size);
+        free(window);
+    }
+    close(windows->fd);
+    pthread_mutex_destroy(&windows->lock);
+}
+
+static void window_unlink(struct data_windows *windows, struct data_window *window) {
+    *(window->prev ? &window->prev->next : &windows->head) = window->next;
+    *(window->next ? &window->next->prev : &windows->tail) = window->prev;
+}
+
+static void window_push(struct data_windows *windows, struct data_window *window) {
+    window->prev = NULL;
+    window->next = windows->head;
+    *(windows->head ? &windows->head->prev : &windows->tail) = window;
+    windows->head = window;
+}
+
+// from offset to the end of the window it ended up in; the caller has checked it's inside the file
+static prange_t window_get(struct data_windows *windows, uint64_t offset, size_t size, bool pin) {
+    pthread_mutex_lock(&windows->lock);
+    struct data_window *window;
+    for(window = windows->head; window; window = window->next) {
+        if(offset >= window->offset && offset - window->offset + size <= window->size) break;
+    }
+    if(window) {
+        window_unlink(windows, window);
+    } else {
+        uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+        uint64_t start = offset & ~(uint64_t) (WINDOW_SIZE - 1);
+        uint64_t end = max(start + WINDOW_SIZE, (offset + size + page - 1) & ~(page - 1));
+        end = min(end, (windows->file_size + page - 1) & ~(page - 1));
+        if(end - start > SIZE_MAX) {
+            pthread_mutex_unlock(&windows->lock);
+            die("window too big: %llx", (unsigned long long) (end - start));
+        }
+        size_t len = (size_t) (end - start);
+        // make room, skipping pinned windows
+        for(struct data_window *old = windows->tail, *prev; old && windows->mapped + len > windows->budget; old = prev) {
+            prev = old->prev;
+            if(old->pins) continue;
+            window_unlink(windows, old);
+            munmap(old->ptr, old->size);
+            windows->mapped -= old->size;
+            free(old);
+        }
+        void *ptr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, windows->fd, (off_t) start);
+        if(ptr == MAP_FAILED || !(window = malloc(sizeof(*window)))) {
+            int err = errno;
+            if(ptr != MAP_FAILED) munmap(ptr, len);
+            pthread_mutex_unlock(&windows->lock);
+            errno = err;
+            edie("could not map window (%llx, %zx)", (unsigned long long) start, len);
+        }
+        *window = (struct data_window) {NULL, NULL, start, len, ptr, 0};
+        windows->mapped += len;
+    }
+    window_push(windows, window);
+    if(pin) window->pins++;
+    prange_t ret = {window->ptr + (offset - window->offset), window->size - (size_t) (offset - window->offset)};
+    pthread_mutex_unlock(&windows->lock);
+    return ret;
+}
+
+__attribute__((noinline))
+static prange_t window_rangeconv(range_t range, int flags, bool pin) {
+    struct data_windows *windows = range.binary->windows;
+    if(range.start > windows->file_size || range.size > windows->file_size - range.start) {
+        if(flags & MUST_FIND) {
+            die("offset range (%08llx, %zx) not valid", (uint64_t) range.start, range.size);
+        } else {
+            return (prange_t) {NULL, 0};
+        }
+    }
+    prange_t pr = window_get(windows, range.start, range.size, pin);
+    if(!(flags & EXTEND_RANGE)) {
+        pr.size = range.size;
+    }
+    return pr;
+}
+
+void *b_window_pin(const struct binary *binary, range_t off_range) {
+    if(!binary->windows) {
+        return rangeconv_off(off_range, MUST_FIND).start;
+    }
+    return window_rangeconv(off_range, MUST_FIND, true).start;
+}
+
+void b_window_unpin(const struct binary *binary, const void *ptr) {
+    struct data_windows *windows = binary->windows;
+    if(!windows) return;
+    pthread_mutex_lock(&windows->lock);
+    for(struct data_window *window = windows->head; window; window = window->next) {
+        if((const char *) ptr >= window->ptr && (const char *) ptr < window->ptr + window->size && window->pins) {
+            window->pins--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&windows->lock);
+}
+
 inline prange_t rangeconv(range_t range, int flags) {
     addr_t address; addr_t offset; size_t size;
     if(rangeconv_stuff(range.binary, range.start, false, &address, &offset, &size)) {
@@ -49,6 +381,9 @@ inline prange_t rangeconv_off(range_t range, int flags) {
         // dyld caches are weird.
         range.start = range.binary->header_offset;
     }
+    if(__builtin_expect(range.binary->windows != NULL, 0)) {
+        return window_rangeconv(range, flags, false);
+    }
     pr.start = (char *) range.binary->valid_range.start + range.start;
     pr.size = range.size;
     if(!prange_check(range.binary, pr)) {
@@ -96,6 +431,11 @@ addr_t b_sym(const struct binary *binary, const char *name, int options) {
     return result;
 }
 
+bool b_try_sym(const struct binary *binary, const char *name, int options, addr_t *result, struct data_status *status) {
+    *result = 0;
+    return DATA_TRY(status, *result = b_sym(binary, name, options));
+}
+
 void b_copy_syms(const struct binary *binary, struct data_sym **syms, uint32_t *nsyms, int options) {
     if(!binary->_copy_syms) {
         *syms = NULL;
@@ -105,7 +445,273 @@ void b_copy_syms(const struct binary *binary, struct data_sym **syms, uint32_t *
     binary->_copy_syms(binary, syms, nsyms, options);
 }
 
+struct addr_sym_key {
+    addr_t address;
+    uint32_t sym;
+};
+
+static int addr_sym_key_cmp(const void *a, const void *b) {
+    const struct addr_sym_key *x = a, *y = b;
+    if(x->address != y->address) return x->address < y->address ? -1 : 1;
+    return x->sym < y->sym ? -1 : x->sym > y->sym;
+}
+
+static int vm_range_cmp(const void *a, const void *b) {
+    const range_t *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static struct data_addr_sym_table *build_addr_syms(const struct binary *binary) {
+    struct data_sym *syms;
+    uint32_t nsyms;
+    b_copy_syms(binary, &syms, &nsyms, PRIVATE_SYM);
+
+    // sort by address; on ties, the first symbol in the table wins
+    struct addr_sym_key *keys = malloc(sizeof(*keys) * nsyms);
+    uint32_t nkeys = 0;
+    const char *lo = NULL, *hi = NULL;
+    for(uint32_t i = 0; i < nsyms; i++) {
+        if(!syms[i].address) continue;
+        keys[nkeys++] = (struct addr_sym_key) {syms[i].address, i};
+        if(!lo || syms[i].name < lo) lo = syms[i].name;
+        if(!hi || syms[i].name > hi) hi = syms[i].name;
+    }
+    if(nkeys && (size_t) (hi - lo) > UINT32_MAX) {
+        die("symbol names are too far apart");
+    }
+    qsort(keys, nkeys, sizeof(*keys), addr_sym_key_cmp);
+
+    // the segment keys leave out zerofill, so sort our own copy
+    range_t *segs = malloc(sizeof(*segs) * binary->nsegments);
+    uint32_t nsegs = 0;
+    for(uint32_t i = 0; i < binary->nsegments; i++) {
+        if(binary->segments[i].vm_range.size) {
+            segs[nsegs++] = binary->segments[i].vm_range;
+        }
+    }
+    qsort(segs, nsegs, sizeof(*segs), vm_range_cmp);
+
+    // +1 so it's never NULL
+    struct data_addr_sym *out = b_alloc(binary, sizeof(*out) * (nkeys + 1));
+    uint32_t n = 0, s = 0;
+    for(uint32_t i = 0; i < nkeys; i++) {
+        addr_t address = keys[i].address;
+        if(i && address == keys[i - 1].address) continue;
+        while(s + 1 < nsegs && segs[s + 1].start <= address) s++;
+        if(!nsegs || address < segs[s].start || address - segs[s].start >= segs[s].size) continue;
+        addr_t end = segs[s].start + segs[s].size;
+        uint32_t j = i + 1;
+        while(j < nkeys && keys[j].address == address) j++;
+        if(j < nkeys && keys[j].address < end) end = keys[j].address;
+        out[n++] = (struct data_addr_sym) {address, end, syms[keys[i].sym].name - lo, 0};
+    }
+
+    free(segs);
+    free(keys);
+    free(syms);
+    struct data_addr_sym_table *table = b_alloc(binary, sizeof(*table));
+    table->syms = out;
+    table->nsyms = n;
+    table->names = lo;
+    return table;
+}
+
+static const struct data_addr_sym_table *addr_sym_table(const struct binary *binary) {
+    const struct data_addr_sym_table *table = b_lazy_get(binary->addr_syms);
+    return table ? table : b_lazy_set(((struct binary *) binary)->addr_syms, build_addr_syms(binary));
+}
+
+// number of entries with address <= addr, searching [lo, hi)
+static uint32_t addr_sym_upper(const struct data_addr_sym *syms, uint32_t lo, uint32_t hi, addr_t addr) {
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(syms[mid].address <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static const char *addr_sym_result(const struct data_addr_sym_table *table, uint32_t upper, addr_t addr, addr_t *offset) {
+    const struct data_addr_sym *sym = upper ? &table->syms[upper - 1] : NULL;
+    if(!sym || addr >= sym->end) {
+        if(offset) *offset = 0;
+        return NULL;
+    }
+    if(offset) *offset = addr - sym->address;
+    return table->names + sym->name;
+}
+
+const char *b_addr_to_sym(const struct binary *binary, addr_t addr, addr_t *offset) {
+    const struct data_addr_sym_table *table = addr_sym_table(binary);
+    return addr_sym_result(table, addr_sym_upper(table->syms, 0, table->nsyms, addr), addr, offset);
+}
+
+void b_addrs_to_syms(const struct binary *binary, const addr_t *addrs, size_t count, const char **names, addr_t *offsets) {
+    const struct data_addr_sym_table *table = addr_sym_table(binary);
+    const struct data_addr_sym *syms = table->syms;
+    uint32_t n = table->nsyms, upper = 0;
+    addr_t prev = 0;
+    for(size_t i = 0; i < count; i++) {
+        addr_t addr = addrs[i];
+        if(addr < prev) {
+            // out of order
+            upper = addr_sym_upper(syms, 0, upper, addr);
+        } else {
+            // walk forward a little, then give up and search the rest
+            uint32_t stop = n - upper > 8 ? upper + 8 : n;
+            while(upper < stop && syms[upper].address <= addr) upper++;
+            if(upper == stop && upper < n && syms[upper].address <= addr) {
+                upper = addr_sym_upper(syms, upper, n, addr);
+            }
+        }
+        prev = addr;
+        names[i] = addr_sym_result(table, upper, addr, offsets ? &offsets[i] : NULL);
+    }
+}
+
 void b_store(struct binary *binary, const char *path) {
     store_file(binary->valid_range, path, 0755);
 }
 
+bool b_store_incremental(struct binary *binary, const char *path) {
+    if(!binary->store_state) {
+        binary->store_state = b_alloc(binary, sizeof(*binary->store_state));
+    }
+    return store_file_incremental(binary->valid_range, path, 0755, binary->store_state);
+}
+
+static void journal_protect(const struct data_journal *journal, void *start, size_t size, int prot) {
+    // only whole pages of valid_range are protected
+    char *lo = max((char *) start, (char *) journal->protected.start);
+    char *hi = min((char *) start + size, (char *) journal->protected.start + journal->protected.size);
+    if(lo >= hi) return;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    lo = (char *) ((uintptr_t) lo & ~(uintptr_t) (page - 1));
+    hi = (char *) (((uintptr_t) hi + page - 1) & ~(uintptr_t) (page - 1));
+    if(mprotect(lo, (size_t) (hi - lo), prot)) {
+        edie("could not mprotect");
+    }
+}
+
+void b_journal_start(struct binary *binary) {
+    if(binary->journal) return;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    struct data_journal *journal = b_alloc(binary, sizeof(*journal));
+    char *start = binary->valid_range.start, *end = start + binary->valid_range.size;
+    char *lo = (char *) (((uintptr_t) start + page - 1) & ~(uintptr_t) (page - 1));
+    char *hi = (char *) ((uintptr_t) end & ~(uintptr_t) (page - 1));
+    if(lo < hi) {
+        journal->protected = (prange_t) {lo, (size_t) (hi - lo)};
+        journal->was_private = b_alloc(binary, (journal->protected.size / page + 7) / 8);
+        prange_private_pages(journal->protected, journal->was_private);
+        journal_protect(journal, lo, (size_t) (hi - lo), PROT_READ);
+    }
+    binary->journal = journal;
+}
+
+void b_journal_stop(struct binary *binary) {
+    struct data_journal *journal = binary->journal;
+    if(!journal) return;
+    journal_protect(journal, journal->protected.start, journal->protected.size, PROT_READ | PROT_WRITE);
+    free(journal->patches);
+    free(journal->bytes);
+    binary->journal = NULL;
+}
+
+void b_patch(struct binary *binary, addr_t addr, const void *data, size_t size) {
+    void *ptr = rangeconv((range_t) {binary, addr, size}, MUST_FIND).start;
+    struct data_journal *journal = binary->journal;
+    if(!journal) {
+        memcpy(ptr, data, size);
+        return;
+    }
+    if(journal->npatches == journal->patches_capacity) {
+        journal->patches_capacity = journal->patches_capacity ? journal->patches_capacity * 2 : 16;
+        journal->patches = realloc(journal->patches, journal->patches_capacity * sizeof(*journal->patches));
+    }
+    if(journal->nbytes + 2 * size > journal->bytes_capacity) {
+        journal->bytes_capacity = max(journal->bytes_capacity * 2, journal->nbytes + 2 * size);
+        journal->bytes = realloc(journal->bytes, journal->bytes_capacity);
+    }
+    if(!journal->patches || !journal->bytes) {
+        die("out of memory");
+    }
+    journal->patches[journal->npatches++] = (struct data_patch) {addr, size, journal->nbytes};
+    memcpy(journal->bytes + journal->nbytes, ptr, size);
+    memcpy(journal->bytes + journal->nbytes + size, data, size);
+    journal->nbytes += 2 * size;
+
+    journal_protect(journal, ptr, size, PROT_READ | PROT_WRITE);
+    memcpy(ptr, data, size);
+    journal_protect(journal, ptr, size, PROT_READ);
+}
+
+void b_undo(struct binary *binary, uint32_t mark) {
+    struct data_journal *journal = binary->journal;
+    if(!journal || mark >= journal->npatches) return;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *base = journal->protected.start;
+    size_t npages = journal->protected.size / page;
+    // the protected pages the undone patches touched, and then the ones the remaining patches touch
+    autofree uint8_t *touched = calloc(1, npages / 8 + 1), *kept = calloc(1, npages / 8 + 1);
+    if(!touched || !kept) {
+        die("out of memory");
+    }
+    for(uint32_t i = journal->npatches; i-- > 0;) {
+        const struct data_patch *patch = &journal->patches[i];
+        char *ptr = rangeconv((range_t) {binary, patch->address, patch->size}, MUST_FIND).start;
+        if(i >= mark) {
+            journal_protect(journal, ptr, patch->size, PROT_READ | PROT_WRITE);
+            memcpy(ptr, journal->bytes + patch->data, patch->size);
+            journal_protect(journal, ptr, patch->size, PROT_READ);
+        }
+        uint8_t *bitmap = i >= mark ? touched : kept;
+        for(char *p = ptr; p < ptr + patch->size; p = (char *) (((uintptr_t) p + page) & ~(uintptr_t) (page - 1))) {
+            if(p >= base && p < base + journal->protected.size) {
+                size_t n = (size_t) (p - base) / page;
+                bitmap[n / 8] |= (uint8_t) (1 << (n % 8));
+            }
+        }
+    }
+    // a page that was clean to begin with and has only been written through the journal is now
+    // byte-for-byte what's underneath, so the private copy can go
+    bool dropped = false;
+    for(size_t n = 0; n < npages; n++) {
+        uint8_t bit = (uint8_t) (1 << (n % 8));
+        if((touched[n / 8] & bit) && !(kept[n / 8] & bit) && !(journal->was_private[n / 8] & bit)) {
+            prange_advise((prange_t) {base + n * page, page}, ADVISE_DONTNEED);
+            dropped = true;
+        }
+    }
+    // ...unless the file has been written since (say b_store_incremental back to it), in which case
+    // those pages now come back patched; put the old bytes back over them again
+    for(uint32_t i = journal->npatches; dropped && i-- > mark;) {
+        const struct data_patch *patch = &journal->patches[i];
+        char *ptr = rangeconv((range_t) {binary, patch->address, patch->size}, MUST_FIND).start;
+        if(memcmp(ptr, journal->bytes + patch->data, patch->size)) {
+            journal_protect(journal, ptr, patch->size, PROT_READ | PROT_WRITE);
+            memcpy(ptr, journal->bytes + patch->data, patch->size);
+            journal_protect(journal, ptr, patch->size, PROT_READ);
+        }
+    }
+    journal->npatches = mark;
+    journal->nbytes = mark ? journal->patches[mark - 1].data + 2 * journal->patches[mark - 1].size : 0;
+}
+
+void b_journal_replay(const struct binary *from, struct binary *to) {
+    const struct data_journal *journal = from->journal;
+    if(!journal) return;
+    for(uint32_t i = 0; i < journal->npatches; i++) {
+        const struct data_patch *patch = &journal->patches[i];
+        const uint8_t *old = journal->bytes + patch->data;
+        const void *ptr = rangeconv((range_t) {to, patch->address, patch->size}, MUST_FIND).start;
+        if(memcmp(ptr, old, patch->size)) {
+            die("patch %u at %08llx doesn't apply", i, (uint64_t) patch->address);
+        }
+        b_patch(to, patch->address, old + patch->size, patch->size);
+    }
+}
+
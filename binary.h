@@ -18,6 +18,8 @@ struct dyld_cache_header;
 struct shared_file_mapping_np;
 struct mach_header;
 struct dysymtab_command;
+struct data_arena;
+struct data_windows;
 
 struct data_segment {
     range_t file_range;
@@ -25,11 +27,49 @@ struct data_segment {
     void *native_segment;
 };
 
+// sorted by start for rangeconv; segments with no file data are left out
+struct data_segment_key {
+    addr_t start;
+    size_t size;
+    uint32_t seg;
+};
+
 struct data_sym {
     const char *name;
     addr_t address;
 };
 
+// sorted by address for b_addr_to_sym; a symbol ends at the next one or at its segment's end
+struct data_addr_sym {
+    addr_t address, end;
+    uint32_t name; // offset from names
+    // the index files hold these as they are, so the padding is spelled out for i386 and x86_64 to agree
+    uint32_t reserved;
+};
+
+struct data_addr_sym_table {
+    struct data_addr_sym *syms;
+    uint32_t nsyms;
+    const char *names;
+};
+
+// see b_journal_start
+struct data_patch {
+    addr_t address;
+    size_t size;
+    size_t data; // offset into the journal's bytes: the old bytes, then the new ones
+};
+
+struct data_journal {
+    struct data_patch *patches;
+    uint32_t npatches, patches_capacity;
+    uint8_t *bytes;
+    size_t nbytes, bytes_capacity;
+    // the whole pages of valid_range, which are kept read-only, and which of them were already private copies to begin with
+    prange_t protected;
+    uint8_t *was_private;
+};
+
 struct binary {
     bool valid;
     
@@ -45,6 +85,7 @@ struct binary {
 
     uint32_t reserved[8];
 
+    // no longer used (rangeconv keeps a per-thread hint instead); kept so the fields after it don't move
     uint32_t last_seg;
     
     struct binary *reexports;
@@ -55,12 +96,41 @@ struct binary {
 
     addr_t (*_sym)(const struct binary *binary, const char *name, int options);
     void (*_copy_syms)(const struct binary *binary, struct data_sym **syms, uint32_t *nsyms, int options);
+
+    // built by b_index_segments; NULL if the segments overlap (then rangeconv just scans)
+    struct data_segment_key *vm_index, *file_index;
+    uint32_t nvm_index, nfile_index;
+
+    // built by b_addr_to_sym
+    const struct data_addr_sym_table *addr_syms;
+
+    // everything above that was allocated for this binary; see b_alloc
+    struct data_arena *arena;
+
+    // for b_store_incremental
+    struct data_store_state *store_state;
+
+    // see b_journal_start
+    struct data_journal *journal;
+
+    // see b_open_windows; valid_range is empty then
+    struct data_windows *windows;
 };
 
+// tables that are built on first use hang off a const binary, which may be shared between threads.
+// build them without locks and publish with b_lazy_set; if another thread got there first, that
+// table is returned instead (the loser just stays in the arena).
+#define b_lazy_get(field) data_atomic_load(&(field))
+#define b_lazy_set(field, value) ({ \
+    typeof(field) _value = (value), _old = data_atomic_cas(&(field), NULL, _value); \
+    _old ? _old : _value; \
+})
+
 __BEGIN_DECLS
 
 static inline bool prange_check(const struct binary *binary, prange_t range) {
-    return binary->valid_range.start <= range.start && range.size <= (size_t) ((char *) binary->valid_range.start + binary->valid_range.size - (char *) range.start);
+    char *start = binary->valid_range.start, *end = start + binary->valid_range.size;
+    return start <= (char *) range.start && (char *) range.start <= end && range.size <= (size_t) (end - (char *) range.start);
 }
 
 __attribute__((pure)) prange_t rangeconv(range_t range, int flags);
@@ -69,12 +139,60 @@ __attribute__((pure)) range_t range_to_off_range(range_t range, int flags);
 __attribute__((pure)) range_t off_range_to_range(range_t range, int flags);
 
 void b_init(struct binary *binary);
+// frees everything allocated for the binary (and its reexports) and unmaps the ranges it owns, then b_inits it
+// ranges passed to b_prange_load_* still belong to the caller
+void b_destroy(struct binary *binary);
+// zeroed memory that lives until b_destroy; safe to call from several threads
+void *b_alloc(const struct binary *binary, size_t size);
+// have b_destroy punmap this range
+void b_own_mapping(const struct binary *binary, prange_t range);
+// call after changing segments
+void b_index_segments(struct binary *binary);
+
+// for files too big to map all at once (say, a dyld cache on a 32-bit device): rangeconv maps windows of the
+// file on demand, and unmaps the least recently used ones to stay within budget bytes (give or take pinned
+// windows, and ranges bigger than budget).  the binary is read-only, and a pointer from rangeconv is only good
+// until the binary has to map more windows than fit, so copy out anything you want to keep, and don't share
+// the binary between threads that hold on to pointers.  EXTEND_RANGE on rangeconv_off goes to the end of the window.
+void b_open_windows(struct binary *binary, int fd, size_t budget);
+// rangeconv_off with MUST_FIND, except that on a windowed binary the memory stays mapped until b_window_unpin
+void *b_window_pin(const struct binary *binary, range_t off_range);
+void b_window_unpin(const struct binary *binary, const void *ptr);
 
 // return value is |1 if to_execute is set and it is a thumb symbol
 addr_t b_sym(const struct binary *binary, const char *name, int options);
 void b_copy_syms(const struct binary *binary, struct data_sym **syms, uint32_t *nsyms, int options);
+// false if b_sym would have died; a symbol that's just not there is *result = 0 (unless MUST_FIND)
+bool b_try_sym(const struct binary *binary, const char *name, int options, addr_t *result, struct data_status *status);
+
+// the (private) symbol containing addr, or NULL; offset (if not NULL) is set to addr minus its address
+const char *b_addr_to_sym(const struct binary *binary, addr_t addr, addr_t *offset);
+// same for many addresses at once; fastest if addrs is sorted.  offsets can be NULL
+void b_addrs_to_syms(const struct binary *binary, const addr_t *addrs, size_t count, const char **names, addr_t *offsets);
 
 void b_store(struct binary *binary, const char *path);
+
+// makes valid_range read-only and has b_patch record every change to it, so unpatched pages stay shared with
+// the page cache (and other processes), patches can be undone and the same patches can be replayed elsewhere.
+// reads (rangeconv, b_read32...) see the patches; anything that writes to the binary directly, like
+// b_relocate or inject, will fault, so do that first or not at all.  the binary must own valid_range.
+void b_journal_start(struct binary *binary);
+// makes valid_range writable again and forgets the journal; the patches stay
+void b_journal_stop(struct binary *binary);
+// writes size bytes at addr; journaled if b_journal_start was called
+void b_patch(struct binary *binary, addr_t addr, const void *data, size_t size);
+// a point to undo back to
+static inline uint32_t b_journal_mark(const struct binary *binary) {
+    return binary->journal ? binary->journal->npatches : 0;
+}
+// undoes every patch since mark, newest first.  pages with no patches left are given back to the page cache
+// (and patched again with the old bytes if the file underneath has changed, say by b_store_incremental to it).
+void b_undo(struct binary *binary, uint32_t mark);
+// b_patches the journaled patches of from onto to (which needn't be journaled), checking that each one's old bytes match
+void b_journal_replay(const struct binary *from, struct binary *to);
+// after the first store to path, later ones only write the pages that changed (see store_file_incremental);
+// also incremental the first time if path is the file the binary was loaded from
+bool b_store_incremental(struct binary *binary, const char *path);
 #define b_macho_store b_store
 
 static inline uint8_t b_pointer_size(const struct binary *binary) {
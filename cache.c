@@ -0,0 +1,363 @@
+#include "cache.h"
+#include "mach-o/binary.h"
+#include "dyldcache/binary.h"
+#include <sys/stat.h>
+#include <stddef.h>
+#include <pthread.h>
+
+enum cache_kind {
+    CACHE_MACHO,
+    CACHE_DYLDCACHE,
+    CACHE_DYLD_IMAGE,
+};
+
+struct cache_entry;
+
+struct cache_key {
+    enum cache_kind kind;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_ns;
+    off_t size;
+    // for CACHE_DYLD_IMAGE
+    struct cache_entry *parent;
+    char *name;
+};
+
+struct cache_entry {
+    struct cache_entry *hash_next;
+    // only while nobody's using it
+    struct cache_entry *lru_prev, *lru_next;
+    struct cache_key key;
+    uint32_t hash;
+    unsigned int refs;
+    // someone's still loading it; wait on cache_cond
+    bool loading;
+    pthread_t loader;
+    // if the load failed, for the threads that were waiting on it (the entry is out of the hash table then)
+    struct data_status status;
+    // for CACHE_DYLD_IMAGE, the cached binaries that binary.reexports are copies of, each holding a reference
+    const struct binary **reexports;
+    unsigned int nreexports;
+    struct binary binary;
+};
+
+#define CACHE_BUCKETS 256
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static struct cache_entry *cache_buckets[CACHE_BUCKETS];
+// the unused entries, most recently used first
+static struct cache_entry *lru_head, *lru_tail;
+static unsigned int lru_count, cache_limit = 16;
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while(size--) {
+        hash = (hash ^ *p++) * 16777619;
+    }
+    return hash;
+}
+
+static uint32_t key_hash(const struct cache_key *key) {
+    uint32_t hash = 2166136261;
+    hash = hash_bytes(hash, &key->kind, sizeof(key->kind));
+    hash = hash_bytes(hash, &key->dev, sizeof(key->dev));
+    hash = hash_bytes(hash, &key->ino, sizeof(key->ino));
+    hash = hash_bytes(hash, &key->mtime_ns, sizeof(key->mtime_ns));
+    hash = hash_bytes(hash, &key->size, sizeof(key->size));
+    hash = hash_bytes(hash, &key->parent, sizeof(key->parent));
+    if(key->name) {
+        hash = hash_bytes(hash, key->name, strlen(key->name));
+    }
+    return hash;
+}
+
+static bool key_equal(const struct cache_key *a, const struct cache_key *b) {
+    return a->kind == b->kind && a->dev == b->dev && a->ino == b->ino && a->mtime_ns == b->mtime_ns && a->size == b->size &&
+           a->parent == b->parent && (a->name ? b->name && !strcmp(a->name, b->name) : !b->name);
+}
+
+static struct cache_entry *entry_of(const struct binary *binary) {
+    return (struct cache_entry *) ((char *) binary - offsetof(struct cache_entry, binary));
+}
+
+// called with cache_lock held
+static void lru_remove(struct cache_entry *entry) {
+    *(entry->lru_prev ? &entry->lru_prev->lru_next : &lru_head) = entry->lru_next;
+    *(entry->lru_next ? &entry->lru_next->lru_prev : &lru_tail) = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+    lru_count--;
+}
+
+// called with cache_lock held
+static void hash_remove(struct cache_entry *entry) {
+    struct cache_entry **pp = &cache_buckets[entry->hash % CACHE_BUCKETS];
+    while(*pp != entry) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = entry->hash_next;
+    entry->hash_next = NULL;
+}
+
+// called with cache_lock held; takes unused entries out of the cache until there are at most keep, and
+// returns them (linked through hash_next) for entries_destroy
+static struct cache_entry *evict(unsigned int keep) {
+    struct cache_entry *victims = NULL;
+    while(lru_count > keep) {
+        struct cache_entry *entry = lru_tail;
+        lru_remove(entry);
+        hash_remove(entry);
+        entry->hash_next = victims;
+        victims = entry;
+    }
+    return victims;
+}
+
+// without cache_lock, since this can take a while and images give back their dyld cache
+static void entries_destroy(struct cache_entry *entry) {
+    while(entry) {
+        struct cache_entry *next = entry->hash_next;
+        // binary.reexports belong to other entries
+        entry->binary.nreexports = 0;
+        b_destroy(&entry->binary);
+        for(unsigned int i = 0; i < entry->nreexports; i++) {
+            b_cache_release(entry->reexports[i]);
+        }
+        free(entry->reexports);
+        if(entry->key.parent) {
+            b_cache_release(&entry->key.parent->binary);
+        }
+        free(entry->key.name);
+        free(entry);
+        entry = next;
+    }
+}
+
+// finds the entry for key, waiting if it's being loaded, or adds one for the caller to load (and sets
+// *created); NULL, with status filled in, if it couldn't (including if the load waited on failed)
+static struct cache_entry *cache_get(const struct cache_key *key, bool *created, struct data_status *status) {
+    uint32_t hash = key_hash(key);
+    *created = false;
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *entry;
+    for(entry = cache_buckets[hash % CACHE_BUCKETS]; entry; entry = entry->hash_next) {
+        if(entry->hash == hash && key_equal(&entry->key, key)) break;
+    }
+    if(entry) {
+        if(entry->loading && pthread_equal(entry->loader, pthread_self())) {
+            // an image that ends up reexporting itself
+            pthread_mutex_unlock(&cache_lock);
+            status->failed = true;
+            snprintf(status->message, sizeof(status->message), "%s: %s reexports itself", __func__, key->name ? key->name : "?");
+            return NULL;
+        }
+        // the reference keeps a failed entry around until we've read why
+        if(!entry->refs++) {
+            lru_remove(entry);
+        }
+        while(entry->loading) {
+            pthread_cond_wait(&cache_cond, &cache_lock);
+        }
+        struct cache_entry *victim = NULL;
+        if(entry->status.failed) {
+            *status = entry->status;
+            if(!--entry->refs) {
+                victim = entry;
+            }
+            entry = NULL;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        entries_destroy(victim);
+        return entry;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    char *name = key->name ? strdup(key->name) : NULL;
+    if(!entry || (key->name && !name)) {
+        pthread_mutex_unlock(&cache_lock);
+        free(entry);
+        free(name);
+        status->failed = true;
+        snprintf(status->message, sizeof(status->message), "%s: out of memory", __func__);
+        return NULL;
+    }
+    entry->key = *key;
+    entry->key.name = name;
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->loading = true;
+    entry->loader = pthread_self();
+    b_init(&entry->binary);
+    if(key->parent) {
+        // the image's binary points into its dyld cache
+        key->parent->refs++;
+    }
+    struct cache_entry **bucket = &cache_buckets[hash % CACHE_BUCKETS];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    pthread_mutex_unlock(&cache_lock);
+    *created = true;
+    return entry;
+}
+
+// status is the load's; if it failed, everyone waiting gets it too, and the entry goes once they've seen it
+static void cache_loaded(struct cache_entry *entry, const struct data_status *status) {
+    bool last = false;
+    pthread_mutex_lock(&cache_lock);
+    entry->loading = false;
+    if(status->failed) {
+        entry->status = *status;
+        hash_remove(entry);
+        last = !--entry->refs;
+    }
+    pthread_cond_broadcast(&cache_cond);
+    pthread_mutex_unlock(&cache_lock);
+    if(last) {
+        entries_destroy(entry);
+    }
+}
+
+static void load_file_entry(struct cache_entry *entry, int fd, const char *filename) {
+    // the binary is shared, so it stays read-only
+    prange_t pr = load_fd(fd, false);
+    b_own_mapping(&entry->binary, pr);
+    if(entry->key.kind == CACHE_DYLDCACHE) {
+        b_prange_load_dyldcache(&entry->binary, pr, filename);
+    } else {
+        b_prange_load_macho(&entry->binary, pr, 0, filename);
+    }
+}
+
+static const struct binary *cache_load_file(const char *filename, enum cache_kind kind) {
+#define _arg filename
+    // stat the fd we load from, so the key matches what actually got loaded
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) {
+        edie("could not open");
+    }
+    struct stat st;
+    if(fstat(fd, &st)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        edie("could not stat");
+    }
+    struct cache_key key = {
+        .kind = kind,
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+#ifdef __APPLE__
+        .mtime_ns = (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec,
+#else
+        .mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec,
+#endif
+        .size = st.st_size,
+    };
+    bool created;
+    struct data_status status;
+    struct cache_entry *entry = cache_get(&key, &created, &status);
+    if(created) {
+        DATA_TRY(&status, load_file_entry(entry, fd, filename));
+        cache_loaded(entry, &status);
+        if(status.failed) {
+            entry = NULL;
+        }
+    }
+    close(fd);
+    if(!entry) {
+        _die("%s\n", status.message);
+    }
+    return &entry->binary;
+#undef _arg
+}
+
+const struct binary *b_cache_load_macho(const char *filename) {
+    return cache_load_file(filename, CACHE_MACHO);
+}
+
+const struct binary *b_cache_load_dyldcache(const char *filename) {
+    return cache_load_file(filename, CACHE_DYLDCACHE);
+}
+
+static void load_image_entry(struct cache_entry *entry, const struct binary *cache, const char *name) {
+    struct binary *binary = &entry->binary;
+    b_dyldcache_load_macho_noreexports(cache, name, binary);
+    // reexports come out of the cache too, so each one is only loaded once however many images reexport it
+    unsigned int count = 0;
+    CMD_ITERATE(b_mach_hdr(binary), cmd) {
+        if(cmd->cmd == LC_REEXPORT_DYLIB) count++;
+    }
+    if(count == 0 || count >= 1000) return;
+    entry->reexports = calloc(count, sizeof(*entry->reexports));
+    if(!entry->reexports) {
+        die("out of memory");
+    }
+    // b_sym wants them by value; each copy shares everything with the cached binary it was taken from
+    struct binary *copies = b_alloc(binary, count * sizeof(*copies));
+    CMD_ITERATE(b_mach_hdr(binary), cmd) {
+        if(cmd->cmd == LC_REEXPORT_DYLIB) {
+            const char *reexport = convert_lc_str(cmd, ((struct dylib_command *) cmd)->dylib.name.offset);
+            const struct binary *shared = b_cache_dyldcache_load_macho(cache, reexport);
+            entry->reexports[entry->nreexports] = shared;
+            copies[entry->nreexports++] = *shared;
+        }
+    }
+    binary->reexports = copies;
+    binary->nreexports = count;
+}
+
+const struct binary *b_cache_dyldcache_load_macho(const struct binary *cache, const char *name) {
+    struct cache_key key = {
+        .kind = CACHE_DYLD_IMAGE,
+        .parent = entry_of(cache),
+        .name = (char *) name,
+    };
+    bool created;
+    struct data_status status;
+    struct cache_entry *entry = cache_get(&key, &created, &status);
+    if(created) {
+        DATA_TRY(&status, load_image_entry(entry, cache, name));
+        cache_loaded(entry, &status);
+        if(status.failed) {
+            entry = NULL;
+        }
+    }
+    if(!entry) {
+        _die("%s\n", status.message);
+    }
+    return &entry->binary;
+}
+
+void b_cache_release(const struct binary *binary) {
+    struct cache_entry *entry = entry_of(binary), *victims = NULL;
+    pthread_mutex_lock(&cache_lock);
+    if(!--entry->refs) {
+        entry->lru_next = lru_head;
+        *(lru_head ? &lru_head->lru_prev : &lru_tail) = entry;
+        lru_head = entry;
+        lru_count++;
+        victims = evict(cache_limit);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    entries_destroy(victims);
+}
+
+void b_cache_set_limit(unsigned int count) {
+    pthread_mutex_lock(&cache_lock);
+    cache_limit = count;
+    struct cache_entry *victims = evict(cache_limit);
+    pthread_mutex_unlock(&cache_lock);
+    entries_destroy(victims);
+}
+
+void b_cache_flush() {
+    // dropping an image can leave its dyld cache unused, so go until there's nothing left
+    while(1) {
+        pthread_mutex_lock(&cache_lock);
+        struct cache_entry *victims = evict(0);
+        pthread_mutex_unlock(&cache_lock);
+        if(!victims) break;
+        entries_destroy(victims);
+    }
+}
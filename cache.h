@@ -0,0 +1,24 @@
+#pragma once
+#include "binary.h"
+
+// A process-wide cache of loaded binaries, keyed by the file's (device, inode, mtime, size), so loading
+// the same file again just returns the binary that's already been parsed.  The binaries are shared with
+// everyone else who loaded them: treat them as read-only (no b_relocate, b_patch, inject, b_destroy...).
+
+__BEGIN_DECLS
+
+const struct binary *b_cache_load_macho(const char *filename);
+const struct binary *b_cache_load_dyldcache(const char *filename);
+// an image from a cached dyld cache, with its reexports (which come from the cache as well); keeps the
+// cache loaded while it's around
+const struct binary *b_cache_dyldcache_load_macho(const struct binary *cache, const char *name);
+// every binary from b_cache_* needs one of these; when nobody's using it, it's kept around in case it gets
+// loaded again until the least recently used ones get pushed out
+void b_cache_release(const struct binary *binary);
+
+// how many binaries nobody's using to keep (default 16)
+void b_cache_set_limit(unsigned int count);
+// throws out all binaries nobody's using
+void b_cache_flush();
+
+__END_DECLS
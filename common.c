@@ -4,10 +4,180 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <stdarg.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 #ifdef __APPLE__
 #include <mach/mach.h>
 #endif
 
+#ifdef __linux__
+// Linux has no vm_remap, but a MAP_PRIVATE file mapping can be duplicated by mapping the same file
+// pages again and copying over only the pages the source has privately modified (which pagemap
+// tells us).  /proc/self/maps says which file is behind the source.
+struct file_mapping {
+    char *start, *end;
+    off_t offset;
+    unsigned int dev_major, dev_minor;
+    ino_t ino;
+    char path[4096];
+};
+
+// the private file mapping containing ptr, merged with any continuation of it, or else the start of the next one in *next
+static bool find_file_mapping(FILE *maps, const char *ptr, const char *limit, struct file_mapping *out, const char **next) {
+    char line[4096 + 128];
+    bool found = false;
+    *next = limit;
+    rewind(maps);
+    while(fgets(line, sizeof(line), maps)) {
+        unsigned long start, end, ino;
+        unsigned long long offset;
+        unsigned int dev_major, dev_minor;
+        char perms[8];
+        int path_pos = 0;
+        if(sscanf(line, "%lx-%lx %7s %llx %x:%x %lu %n", &start, &end, perms, &offset, &dev_major, &dev_minor, &ino, &path_pos) < 7) continue;
+        if(!ino || perms[3] != 'p' || line[path_pos] != '/') continue;
+        if(found) {
+            if((char *) start == out->end && ino == out->ino && dev_major == out->dev_major && dev_minor == out->dev_minor &&
+               (off_t) offset == out->offset + (out->end - out->start)) {
+                out->end = (char *) end;
+                continue;
+            }
+            break;
+        }
+        if((char *) start <= ptr && ptr < (char *) end) {
+            *out = (struct file_mapping) {(char *) start, (char *) end, (off_t) offset, dev_major, dev_minor, (ino_t) ino, ""};
+            size_t len = strcspn(line + path_pos, "\n");
+            if(len >= sizeof(out->path)) return false;
+            memcpy(out->path, line + path_pos, len);
+            out->path[len] = 0;
+            found = true;
+        } else if((char *) start > ptr && (char *) start < *next) {
+            *next = (char *) start;
+        }
+    }
+    return found;
+}
+
+#define PAGEMAP_PRESENT (1ull << 63)
+#define PAGEMAP_SWAPPED (1ull << 62)
+#define PAGEMAP_FILE (1ull << 61)
+
+// a page we've written to, as opposed to one that's still the file's (or not there at all)
+static inline bool pagemap_private(uint64_t entry) {
+    return (entry & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) && !(entry & PAGEMAP_FILE);
+}
+
+static bool read_pagemap(int pagemap, const void *addr, uint64_t *entries, size_t n) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    off_t where = (off_t) ((uintptr_t) addr / page * sizeof(uint64_t));
+    return pread(pagemap, entries, n * sizeof(uint64_t), where) == (ssize_t) (n * sizeof(uint64_t));
+}
+
+// reopen the file behind a mapping, making sure it's still the same file (it might have been
+// replaced, or the path might be " (deleted)"); -1 if not
+static int open_mapped_file(const struct file_mapping *fm, struct stat *st) {
+    int fd = open(fm->path, O_RDONLY | O_CLOEXEC);
+    if(fd != -1 && (fstat(fd, st) || major(st->st_dev) != fm->dev_major || minor(st->st_dev) != fm->dev_minor || st->st_ino != fm->ino)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// map the file pages behind src over dst, then copy the pages of src that are private copies
+// rather than the file's own pages.  dst, src and size are page multiples.
+static bool remap_piece(char *dst, const char *src, size_t size, const struct file_mapping *fm, size_t page, int pagemap) {
+    struct stat st;
+    int fd = open_mapped_file(fm, &st);
+    if(fd == -1) return false;
+    off_t offset = fm->offset + (src - fm->start);
+    // pages past the end of the file fault when touched
+    if(st.st_size <= offset + (off_t) (size - page)) {
+        close(fd);
+        return false;
+    }
+    void *ret = mmap(dst, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+    close(fd);
+    if(ret == MAP_FAILED) {
+        // the anonymous pages underneath might be gone; put some back
+        if(mmap(dst, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            edie("could not restore the mapping");
+        }
+        return false;
+    }
+    uint64_t entries[512];
+    size_t npages = size / page;
+    for(size_t i = 0; i < npages; i += 512) {
+        size_t n = npages - i < 512 ? npages - i : 512;
+        if(!read_pagemap(pagemap, src + i * page, entries, n)) {
+            // can't tell which pages are dirty, so copy them all
+            memcpy(dst + i * page, src + i * page, size - i * page);
+            break;
+        }
+        for(size_t j = 0; j < n; j++) {
+            if(pagemap_private(entries[j])) {
+                memcpy(dst + (i + j) * page, src + (i + j) * page, page);
+            }
+        }
+    }
+    return true;
+}
+
+// below this a plain copy is cheaper
+#define PDUP_REMAP_MIN 0x10000
+
+// dst is zeroed anonymous memory from pdup
+static void pdup_copy(char *dst, const char *src, size_t size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    if(size < PDUP_REMAP_MIN || ((uintptr_t) dst & (page - 1)) != ((uintptr_t) src & (page - 1))) {
+        memcpy(dst, src, size);
+        return;
+    }
+    FILE *maps = fopen("/proc/self/maps", "re");
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if(!maps || pagemap == -1) {
+        if(maps) fclose(maps);
+        if(pagemap != -1) close(pagemap);
+        memcpy(dst, src, size);
+        return;
+    }
+    const char *end = src + size;
+    for(const char *here = src; here < end;) {
+        struct file_mapping fm;
+        const char *next;
+        if(!find_file_mapping(maps, here, end, &fm, &next)) {
+            memcpy(dst + (here - src), here, (size_t) (next - here));
+            here = next;
+            continue;
+        }
+        // only whole pages can be remapped; ragged ends are copied
+        const char *hi = fm.end < end ? fm.end : end;
+        const char *lo = (const char *) (((uintptr_t) here + page - 1) & ~(uintptr_t) (page - 1));
+        const char *hi_page = (const char *) ((uintptr_t) hi & ~(uintptr_t) (page - 1));
+        // mappings end on page boundaries, so a ragged hi is the end of the range: map the whole
+        // last page and zero what's past the end afterwards
+        bool tail = hi != hi_page;
+        if(tail) hi_page += page;
+        if(lo < hi_page && remap_piece(dst + (lo - src), lo, (size_t) (hi_page - lo), &fm, page, pagemap)) {
+            memcpy(dst + (here - src), here, (size_t) (lo - here));
+            if(tail) {
+                memset(dst + size, 0, (size_t) (hi_page - end));
+            }
+        } else {
+            memcpy(dst + (here - src), here, (size_t) (hi - here));
+        }
+        here = hi;
+    }
+    fclose(maps);
+    close(pagemap);
+}
+#endif
+
 prange_t pdup(prange_t range, size_t newsize, size_t offset) {
     if(newsize < offset + range.size) {
         die("pdup: newsize=%zu < offset=%zu + range.size=%zu", newsize, offset, range.size);
@@ -24,12 +194,22 @@ prange_t pdup(prange_t range, size_t newsize, size_t offset) {
     if(kr) {
         die("pdup: kr = %d", (int) kr);
     }
+#elif defined(__linux__)
+    pdup_copy(buf + offset, range.start, range.size);
 #else
     memcpy(buf + offset, range.start, range.size);
 #endif
     return (prange_t) {buf, newsize};
 }
 
+void punmap(prange_t range) {
+    // ranges don't have to start on a page (zip_load's don't)
+    size_t delta = (uintptr_t) range.start & (size_t) (sysconf(_SC_PAGESIZE) - 1);
+    if(range.size && munmap((char *) range.start - delta, range.size + delta)) {
+        edie("could not munmap");
+    }
+}
+
 bool is_valid_range(prange_t range) {
     char c;
     return !mincore(range.start, range.size, (void *) &c);
@@ -76,6 +256,10 @@ addr_t parse_hex_addr(const char *string) {
 }
 
 prange_t load_file(const char *filename, bool rw, mode_t *mode) {
+    return load_file_flags(filename, rw ? LOAD_RW : 0, mode);
+}
+
+prange_t load_file_flags(const char *filename, int flags, mode_t *mode) {
 #define _arg filename
     int fd = open(filename, O_RDONLY);
     if(fd == -1) {
@@ -88,13 +272,37 @@ prange_t load_file(const char *filename, bool rw, mode_t *mode) {
         }
         *mode = st.st_mode;
     }
-    prange_t ret = load_fd(fd, rw);
+    prange_t ret = load_fd_flags(fd, flags);
     close(fd);
     return ret;
 #undef _arg
 }
 
 prange_t load_fd(int fd, bool rw) {
+    return load_fd_flags(fd, rw ? LOAD_RW : 0);
+}
+
+#define HUGE_PAGE_SIZE 0x200000
+
+// reserve enough address space to put the mapping on a huge page boundary, then give back the slop
+static void *reserve_huge_aligned(size_t size) {
+    size_t reserve = size + HUGE_PAGE_SIZE;
+    char *base = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if(base == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *) (((uintptr_t) base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if(aligned != base) {
+        munmap(base, (size_t) (aligned - base));
+    }
+    size_t tail = (size_t) (base + reserve - (aligned + size));
+    if(tail) {
+        munmap(aligned + size, tail);
+    }
+    return aligned;
+}
+
+prange_t load_fd_flags(int fd, int flags) {
     off_t end = lseek(fd, 0, SEEK_END);
     if(end == 0) {
         fprintf(stderr, "load_fd: warning: mapping an empty file\n");
@@ -102,65 +310,570 @@ prange_t load_fd(int fd, bool rw) {
     if(sizeof(off_t) > sizeof(size_t) && end > (off_t) SIZE_MAX) {
         die("too big: %lld", (long long) end);
     }
-    void *buf = mmap(NULL, (size_t) end, PROT_READ | (rw ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0);
+    size_t size = (size_t) end;
+    int mflags = MAP_PRIVATE;
+    void *hint = NULL;
+#ifdef MAP_POPULATE
+    if(flags & LOAD_POPULATE) {
+        mflags |= MAP_POPULATE;
+    }
+#endif
+    if((flags & LOAD_HUGEPAGE) && size >= HUGE_PAGE_SIZE && (hint = reserve_huge_aligned(size))) {
+        mflags |= MAP_FIXED;
+    }
+    void *buf = mmap(hint, size, PROT_READ | ((flags & LOAD_RW) ? PROT_WRITE : 0), mflags, fd, 0);
     if(buf == MAP_FAILED) {
-        edie("could not mmap buf (end=%zu)", (size_t) end);
+        int err = errno;
+        if(hint) munmap(hint, size);
+        errno = err;
+        edie("could not mmap buf (end=%zu)", size);
+    }
+#ifdef MADV_HUGEPAGE
+    if(hint) {
+        madvise(buf, size, MADV_HUGEPAGE);
+    }
+#endif
+#ifndef MAP_POPULATE
+    if(flags & LOAD_POPULATE) {
+        prange_advise((prange_t) {buf, size}, ADVISE_WILLNEED);
+    }
+#endif
+    return (prange_t) {buf, size};
+}
+
+void prange_advise(prange_t range, enum prange_advice advice) {
+    static const int advices[] = {
+        [ADVISE_NORMAL] = MADV_NORMAL,
+        [ADVISE_SEQUENTIAL] = MADV_SEQUENTIAL,
+        [ADVISE_RANDOM] = MADV_RANDOM,
+        [ADVISE_WILLNEED] = MADV_WILLNEED,
+        [ADVISE_DONTNEED] = MADV_DONTNEED,
+    };
+    if(!range.size || (unsigned int) advice >= sizeof(advices) / sizeof(*advices)) return;
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) range.start & ~(page - 1);
+    uintptr_t end = ((uintptr_t) range.start + range.size + page - 1) & ~(page - 1);
+    madvise((void *) start, end - start, advices[advice]);
+}
+
+void prange_private_pages(prange_t range, uint8_t *bitmap) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *start = (char *) ((uintptr_t) range.start & ~(uintptr_t) (page - 1));
+    size_t npages = ((char *) range.start + range.size - start + page - 1) / page;
+    memset(bitmap, 0xff, (npages + 7) / 8);
+#ifdef __linux__
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if(pagemap == -1) return;
+    uint64_t entries[512];
+    for(size_t i = 0; i < npages; i += 512) {
+        size_t n = npages - i < 512 ? npages - i : 512;
+        if(!read_pagemap(pagemap, start + i * page, entries, n)) break;
+        for(size_t j = 0; j < n; j++) {
+            if(!pagemap_private(entries[j])) {
+                bitmap[(i + j) / 8] &= (uint8_t) ~(1 << ((i + j) % 8));
+            }
+        }
+    }
+    close(pagemap);
+#endif
+}
+
+#ifdef __linux__
+static void pwrite_all(int fd, const void *buf, size_t size, off_t offset) {
+    while(size) {
+        ssize_t written = pwrite(fd, buf, size, offset);
+        if(written <= 0) {
+            edie("could not write data");
+        }
+        buf = (const char *) buf + written;
+        size -= (size_t) written;
+        offset += written;
+    }
+}
+
+// how many bytes of src_fd it managed to put into fd without going through userspace
+static size_t clone_range(int fd, off_t offset, int src_fd, off_t src_offset, size_t size) {
+#ifdef FICLONERANGE
+    // shares the blocks on btrfs, xfs etc.; only works on block-aligned ranges
+    struct file_clone_range fcr = {src_fd, (uint64_t) src_offset, size, (uint64_t) offset};
+    if(!ioctl(fd, FICLONERANGE, &fcr)) {
+        return size;
+    }
+#endif
+    size_t done = 0;
+#ifdef SYS_copy_file_range
+    while(done < size) {
+        loff_t in = src_offset + (off_t) done, out = offset + (off_t) done;
+        long copied = syscall(SYS_copy_file_range, src_fd, &in, fd, &out, size - done, 0);
+        if(copied <= 0) break;
+        done += (size_t) copied;
+    }
+#endif
+    return done;
+}
+
+static bool is_zero(const char *p, size_t size) {
+    return !size || (!p[0] && !memcmp(p, p + 1, size - 1));
+}
+
+enum extent_kind { EXTENT_DATA, EXTENT_ZERO, EXTENT_CLONE };
+
+struct extent_run {
+    int fd;
+    const char *base;
+    enum extent_kind kind;
+    const char *start, *end;
+    int src_fd;
+    off_t src_offset;
+};
+
+static void extent_flush(struct extent_run *run) {
+    off_t offset = run->start - run->base;
+    size_t size = (size_t) (run->end - run->start);
+    switch(run->kind) {
+    case EXTENT_ZERO:
+        // leave a hole
+        break;
+    case EXTENT_CLONE: {
+        size_t done = clone_range(run->fd, offset, run->src_fd, run->src_offset, size);
+        pwrite_all(run->fd, run->start + done, size - done, offset + (off_t) done);
+        break;
+    }
+    case EXTENT_DATA:
+        pwrite_all(run->fd, run->start, size, offset);
+        break;
+    }
+    run->start = run->end;
+}
+
+static void extent_add(struct extent_run *run, enum extent_kind kind, const char *start, const char *end, int src_fd, off_t src_offset) {
+    if(run->start != run->end && (kind != run->kind || (kind == EXTENT_CLONE && (src_fd != run->src_fd || src_offset != run->src_offset + (run->end - run->start))))) {
+        extent_flush(run);
+    }
+    if(run->start == run->end) {
+        run->kind = kind;
+        run->start = start;
+        run->src_fd = src_fd;
+        run->src_offset = src_offset;
     }
-    return (prange_t) {buf, (size_t) end};
+    run->end = end;
 }
 
+// below this just write it
+#define STORE_EXTENT_MIN 0x10000
+
+// writes range to the (empty) fd a page at a time: pages that are unmodified pages of a mapped file
+// are cloned from that file, all-zero pages are left as holes, and the rest is written
+static void store_extents(int fd, prange_t range) {
+    struct stat dst_st;
+    if(fstat(fd, &dst_st) || !S_ISREG(dst_st.st_mode) || range.size < STORE_EXTENT_MIN) {
+        // could be a pipe or something, so no pwrite
+        if(write(fd, range.start, range.size) != (ssize_t) range.size) {
+            edie("could not write data");
+        }
+        return;
+    }
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    FILE *maps = fopen("/proc/self/maps", "re");
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    bool can_clone = maps && pagemap != -1;
+    const char *start = range.start, *end = start + range.size;
+    struct extent_run run = {.fd = fd, .base = start, .start = start, .end = start};
+    uint64_t entries[512];
+    for(const char *here = start; here < end;) {
+        struct file_mapping fm;
+        const char *next = end;
+        int src_fd = -1;
+        if(can_clone && find_file_mapping(maps, here, end, &fm, &next)) {
+            struct stat src_st;
+            next = fm.end < end ? fm.end : end;
+            // never clone a file onto itself
+            if((src_fd = open_mapped_file(&fm, &src_st)) != -1 && src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino) {
+                close(src_fd);
+                src_fd = -1;
+            }
+        }
+        size_t nentries = 0, entry = 0;
+        for(const char *p = here; p < next;) {
+            const char *page_start = (const char *) ((uintptr_t) p & ~(uintptr_t) (page - 1));
+            const char *page_end = page_start + page < next ? page_start + page : next;
+            enum extent_kind kind = is_zero(p, (size_t) (page_end - p)) ? EXTENT_ZERO : EXTENT_DATA;
+            if(src_fd != -1) {
+                if(entry == nentries) {
+                    nentries = (size_t) (next - page_start + page - 1) / page;
+                    if(nentries > 512) nentries = 512;
+                    entry = 0;
+                    if(!read_pagemap(pagemap, page_start, entries, nentries)) {
+                        extent_flush(&run);
+                        close(src_fd);
+                        src_fd = -1;
+                    }
+                }
+                if(src_fd != -1 && !pagemap_private(entries[entry++]) && kind == EXTENT_DATA) {
+                    kind = EXTENT_CLONE;
+                }
+            }
+            extent_add(&run, kind, p, page_end, src_fd, src_fd != -1 ? fm.offset + (p - fm.start) : 0);
+            p = page_end;
+        }
+        extent_flush(&run);
+        if(src_fd != -1) close(src_fd);
+        here = next;
+    }
+    if(maps) fclose(maps);
+    if(pagemap != -1) close(pagemap);
+    // for any hole at the end
+    if(ftruncate(fd, (off_t) range.size)) {
+        edie("could not set the size");
+    }
+}
+#endif
+
 void store_file(prange_t range, const char *filename, mode_t mode) {
 #define _arg filename
     int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, mode);
     if(fd == -1) {
         edie("could not open");
     }
+#ifdef __linux__
+    store_extents(fd, range);
+#else
     if(write(fd, range.start, range.size) != (ssize_t) range.size) {
         edie("could not write data");
     }
+#endif
     close(fd);
 #undef _arg
 }
 
+#ifdef __linux__
+#define PAGEMAP_SOFT_DIRTY (1ull << 55)
+
+static pthread_mutex_t soft_dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+// the soft-dirty bits are process wide, so this is bumped every time they're cleared; a store's
+// record of them is only good until the next clear
+static unsigned long soft_dirty_epoch;
+static int soft_dirty_state; // 0 = not checked yet, 1 = works, -1 = doesn't
+
+// called with soft_dirty_lock held
+static bool clear_soft_dirty() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if(fd == -1) return false;
+    bool ok = write(fd, "4", 1) == 1;
+    close(fd);
+    if(ok) soft_dirty_epoch++;
+    return ok;
+}
+
+// called with soft_dirty_lock held; the kernel might not have CONFIG_MEM_SOFT_DIRTY, in which
+// case clear_refs happily accepts 4 and the bit never changes
+static bool soft_dirty_works(int pagemap) {
+    if(!soft_dirty_state) {
+        soft_dirty_state = -1;
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        volatile char *probe = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if(probe != MAP_FAILED) {
+            uint64_t clean, dirty;
+            *probe = 1;
+            if(clear_soft_dirty() && read_pagemap(pagemap, (void *) probe, &clean, 1) && !(clean & PAGEMAP_SOFT_DIRTY)) {
+                *probe = 2;
+                if(read_pagemap(pagemap, (void *) probe, &dirty, 1) && (dirty & PAGEMAP_SOFT_DIRTY)) {
+                    soft_dirty_state = 1;
+                }
+            }
+            munmap((void *) probe, page);
+        }
+    }
+    return soft_dirty_state > 0;
+}
+
+// is range an entire private mapping of this file?  then the file holds everything we haven't written to
+static bool is_mapping_of(prange_t range, const struct stat *st) {
+    FILE *maps = fopen("/proc/self/maps", "re");
+    if(!maps) return false;
+    struct file_mapping fm;
+    const char *next;
+    char *end = (char *) range.start + range.size;
+    bool ret = find_file_mapping(maps, range.start, end, &fm, &next) &&
+               fm.ino == st->st_ino && fm.dev_major == major(st->st_dev) && fm.dev_minor == minor(st->st_dev) &&
+               fm.offset + ((char *) range.start - fm.start) == 0 && fm.end >= end;
+    fclose(maps);
+    return ret;
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// the runs of pages that need writing, clamped to range; false if pagemap couldn't be read
+static bool dirty_runs(prange_t range, int pagemap, bool soft_dirty, prange_t **runs, size_t *nruns) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uint64_t entries[512];
+    char *start = range.start, *end = start + range.size;
+    char *run = NULL;
+    size_t capacity = 16;
+    *runs = malloc(capacity * sizeof(**runs));
+    *nruns = 0;
+    for(char *p = (char *) ((uintptr_t) start & ~(uintptr_t) (page - 1)); p < end;) {
+        size_t n = (size_t) (end - p + page - 1) / page;
+        if(n > 512) n = 512;
+        if(!read_pagemap(pagemap, p, entries, n)) {
+            free(*runs);
+            *runs = NULL;
+            return false;
+        }
+        for(size_t j = 0; j < n; j++, p += page) {
+            // private pages are everything written since the file was mapped, a superset of what
+            // changed since the last store
+            bool dirty = soft_dirty ? (entries[j] & PAGEMAP_SOFT_DIRTY) : pagemap_private(entries[j]);
+            if(dirty && !run) {
+                run = p < start ? start : p;
+            } else if(!dirty && run) {
+                if(*nruns == capacity) {
+                    *runs = realloc(*runs, (capacity *= 2) * sizeof(**runs));
+                }
+                (*runs)[(*nruns)++] = (prange_t) {run, (size_t) (p - run)};
+                run = NULL;
+            }
+        }
+    }
+    if(run) {
+        if(*nruns == capacity) {
+            *runs = realloc(*runs, (capacity + 1) * sizeof(**runs));
+        }
+        (*runs)[(*nruns)++] = (prange_t) {run, (size_t) (end - run)};
+    }
+    return true;
+}
+#endif
+
+bool store_file_incremental(prange_t range, const char *filename, mode_t mode, struct data_store_state *state) {
+#define _arg filename
+#ifdef __linux__
+    enum { FULL, PRIVATE_PAGES, SOFT_DIRTY } how = FULL;
+    int fd = open(filename, O_RDWR | O_CLOEXEC);
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    autofree prange_t *runs = NULL;
+    size_t nruns = 0;
+    struct stat st;
+    bool was_valid = state->valid;
+    // if we die partway, the file is in no known state
+    state->valid = false;
+
+    // nobody can clear the soft-dirty bits between our reading and clearing them
+    pthread_mutex_lock(&soft_dirty_lock);
+    if(fd != -1 && pagemap != -1 && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size == (off_t) range.size) {
+        if(was_valid && state->start == range.start && state->size == range.size &&
+           state->dev == st.st_dev && state->ino == st.st_ino && state->mtime_ns == mtime_ns(&st)) {
+            // we wrote it last; if nothing else has cleared the bits since, they say exactly what changed
+            how = state->epoch && state->epoch == soft_dirty_epoch && soft_dirty_works(pagemap) ? SOFT_DIRTY : PRIVATE_PAGES;
+        } else if(is_mapping_of(range, &st)) {
+            how = PRIVATE_PAGES;
+        }
+    }
+    if(how != FULL && !dirty_runs(range, pagemap, how == SOFT_DIRTY, &runs, &nruns)) {
+        how = FULL;
+    }
+    state->epoch = pagemap != -1 && soft_dirty_works(pagemap) && clear_soft_dirty() ? soft_dirty_epoch : 0;
+    pthread_mutex_unlock(&soft_dirty_lock);
+    if(pagemap != -1) close(pagemap);
+
+    if(how == FULL) {
+        if(fd != -1) close(fd);
+        store_file(range, filename, mode);
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if(fd == -1) {
+            edie("could not open");
+        }
+    } else {
+        for(size_t i = 0; i < nruns; i++) {
+            pwrite_all(fd, runs[i].start, runs[i].size, (char *) runs[i].start - (char *) range.start);
+        }
+    }
+    if(fstat(fd, &st)) {
+        edie("could not stat");
+    }
+    close(fd);
+
+    state->valid = true;
+    state->start = range.start;
+    state->size = range.size;
+    state->dev = st.st_dev;
+    state->ino = st.st_ino;
+    state->mtime_ns = mtime_ns(&st);
+    return how != FULL;
+#else
+    (void) state;
+    store_file(range, filename, mode);
+    return false;
+#endif
+#undef _arg
+}
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int pool_threads = 1, pool_started;
+static bool pool_busy;
+static struct {
+    void (*func)(void *ctx, unsigned int i);
+    void *ctx;
+    unsigned int count, next, done;
+    unsigned long generation;
+} pool_job;
+
+void data_set_threads(unsigned int nthreads) {
+    if(!nthreads) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (unsigned int) ncpu : 1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_threads = nthreads;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+unsigned int data_threads() {
+    pthread_mutex_lock(&pool_lock);
+    unsigned int ret = pool_threads;
+    pthread_mutex_unlock(&pool_lock);
+    return ret;
+}
+
+// called with pool_lock held
+static void pool_run_items() {
+    while(pool_job.next < pool_job.count) {
+        unsigned int i = pool_job.next++;
+        void (*func)(void *ctx, unsigned int i) = pool_job.func;
+        void *ctx = pool_job.ctx;
+        pthread_mutex_unlock(&pool_lock);
+        func(ctx, i);
+        pthread_mutex_lock(&pool_lock);
+        if(++pool_job.done == pool_job.count) {
+            pthread_cond_broadcast(&pool_done_cond);
+        }
+    }
+}
+
+static void *pool_worker(__unused void *arg) {
+    pthread_mutex_lock(&pool_lock);
+    unsigned long seen = pool_job.generation;
+    while(1) {
+        while(pool_job.generation == seen) {
+            pthread_cond_wait(&pool_work_cond, &pool_lock);
+        }
+        seen = pool_job.generation;
+        pool_run_items();
+    }
+    return NULL;
+}
+
+void data_parallel(unsigned int count, void (*func)(void *ctx, unsigned int i), void *ctx) {
+    pthread_mutex_lock(&pool_lock);
+    if(count <= 1 || pool_threads <= 1 || pool_busy) {
+        // nested or concurrent calls just run inline
+        pthread_mutex_unlock(&pool_lock);
+        for(unsigned int i = 0; i < count; i++) {
+            func(ctx, i);
+        }
+        return;
+    }
+    pool_busy = true;
+    while(pool_started < pool_threads - 1) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, pool_worker, NULL)) break;
+        pthread_detach(thread);
+        pool_started++;
+    }
+    pool_job.func = func;
+    pool_job.ctx = ctx;
+    pool_job.count = count;
+    pool_job.next = pool_job.done = 0;
+    pool_job.generation++;
+    pthread_cond_broadcast(&pool_work_cond);
+    pool_run_items();
+    while(pool_job.done < count) {
+        pthread_cond_wait(&pool_done_cond, &pool_lock);
+    }
+    pool_busy = false;
+    pthread_mutex_unlock(&pool_lock);
+}
+
 #if defined(__GNUC__) && !defined(__clang__) && !defined(__arm__)
 #define EXCEPTION_SUPPORT 1
 #endif
 
 // Basically, ctypes/libffi is very fancy but does not support using setjmp() as an exception mechanism.  Running setjmp() directly from Python is... not effective, as you might expect.  So here's an unnecessarily portable hack.
 
+// the innermost DATA_TRY on this thread
+DATA_THREAD_LOCAL(struct data_try *, try_top)
+
+void data_try_push(struct data_try *point, struct data_status *status) {
+    status->failed = false;
+    status->message[0] = 0;
+    point->status = status;
+    point->prev = *try_top();
+    *try_top() = point;
+}
+
+void data_try_pop(struct data_try *point) {
+    *try_top() = point->prev;
+}
+
+__attribute__((noreturn))
+static void try_die(const char *fmt, va_list ap) {
+    struct data_try *point = *try_top();
+    struct data_status *status = point->status;
+    vsnprintf(status->message, sizeof(status->message), fmt, ap);
+    size_t len = strlen(status->message);
+    if(len && status->message[len - 1] == '\n') {
+        status->message[len - 1] = 0;
+    }
+    status->failed = true;
+    *try_top() = point->prev;
+    longjmp(point->jmp, 1);
+}
+
 #ifdef EXCEPTION_SUPPORT
-#include <setjmp.h>
-#include <pthread.h>
 
-static bool call_going;
-static void *call_func;
-static jmp_buf call_jmp;
-static char call_error[256];
+// per thread, so each thread can have its own data_call going
+struct call_state {
+    bool going;
+    void *func;
+    jmp_buf jmp;
+    char error[256];
+};
+DATA_THREAD_LOCAL(struct call_state, call_state)
 
 void data_call_init(void *func) {
-    call_func = func;
-    call_going = true;
-    call_error[0] = 0;
+    struct call_state *call = call_state();
+    call->func = func;
+    call->going = true;
+    call->error[0] = 0;
 }
 
 void data_call(__unused int whatever, ...) {
-    if(!setjmp(call_jmp)) {
-        __builtin_return(__builtin_apply(call_func, __builtin_apply_args(), 32));
+    struct call_state *call = call_state();
+    if(!setjmp(call->jmp)) {
+        __builtin_return(__builtin_apply(call->func, __builtin_apply_args(), 32));
     }
 }
 
 char *data_call_fini() {
-    call_going = false;
-    return call_error;
+    struct call_state *call = call_state();
+    call->going = false;
+    return call->error;
 }
 
 void _die(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     
-    if(call_going) {
-        vsnprintf(call_error, sizeof(call_error), fmt, ap);
-        longjmp(call_jmp, -1);
+    if(*try_top()) {
+        try_die(fmt, ap);
+    } else if(call_state()->going) {
+        struct call_state *call = call_state();
+        vsnprintf(call->error, sizeof(call->error), fmt, ap);
+        longjmp(call->jmp, -1);
     } else {
         vfprintf(stderr, fmt, ap);
         abort();
@@ -173,6 +886,9 @@ void _die(const char *fmt, ...) {
 void _die(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
+    if(*try_top()) {
+        try_die(fmt, ap);
+    }
     vfprintf(stderr, fmt, ap);
     abort();
     va_end(ap);
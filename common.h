@@ -15,6 +15,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/cdefs.h>
+#include <setjmp.h>
 #ifdef PROFILING
 #include <time.h>
 #endif
@@ -33,6 +34,59 @@ static inline void _free_cleanup(void *pp) {
 }
 #define autofree __attribute__((cleanup(_free_cleanup)))
 
+// DATA_THREAD_LOCAL(type, name) defines name(), which returns this thread's own type (zeroed at first).
+// Darwin toolchains (llvm-gcc-4.2 for arm_universal, gcc-mp, clang for old iOS) don't do __thread, so there
+// it's calloced and hung off a pthread key instead.
+#ifdef __APPLE__
+#include <pthread.h>
+#define DATA_THREAD_LOCAL(type, name) \
+    static pthread_key_t name##_key; \
+    static pthread_once_t name##_once = PTHREAD_ONCE_INIT; \
+    static void name##_key_init() { \
+        pthread_key_create(&name##_key, free); \
+    } \
+    static inline type *name() { \
+        pthread_once(&name##_once, name##_key_init); \
+        type *_p = pthread_getspecific(name##_key); \
+        if(!_p) { \
+            if(!(_p = calloc(1, sizeof(type)))) abort(); \
+            pthread_setspecific(name##_key, _p); \
+        } \
+        return _p; \
+    }
+#else
+#define DATA_THREAD_LOCAL(type, name) \
+    static __thread type name##_tls; \
+    static inline type *name() { \
+        return &name##_tls; \
+    }
+#endif
+
+// __atomic_* came in with gcc 4.7; before that (llvm-gcc-4.2 included) there's only __sync_*, which are
+// full barriers
+#if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)
+#define data_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define data_atomic_store(p, value) __atomic_store_n((p), (value), __ATOMIC_RELEASE)
+// returns what *p was, which is expected if value went in
+#define data_atomic_cas(p, expected, value) ({ \
+    typeof(*(p)) _expected = (expected); \
+    __atomic_compare_exchange_n((p), &_expected, (value), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); \
+    _expected; \
+})
+#else
+#define data_atomic_load(p) ({ \
+    typeof(*(p)) _value = *(volatile typeof(*(p)) *) (p); \
+    __sync_synchronize(); \
+    _value; \
+})
+#define data_atomic_store(p, value) ({ \
+    __sync_synchronize(); \
+    *(volatile typeof(*(p)) *) (p) = (value); \
+    __sync_synchronize(); \
+})
+#define data_atomic_cas(p, expected, value) __sync_val_compare_and_swap((p), (expected), (value))
+#endif
+
 __unused static const char *const _arg = (char *) MAP_FAILED;
 
 #define die(fmt, args...) ((_arg == MAP_FAILED) ? \
@@ -41,6 +95,34 @@ __unused static const char *const _arg = (char *) MAP_FAILED;
 
 #define edie(fmt, args...) die(fmt ": %s", ##args, strerror(errno))
 
+// for the try_ variants, which report errors here instead of aborting
+struct data_status {
+    bool failed;
+    char message[256];
+};
+
+// while one of these is pushed, die() on the same thread fills in its status and longjmps back to it
+struct data_try {
+    struct data_try *prev;
+    struct data_status *status;
+    jmp_buf jmp;
+};
+
+// evaluates to true if code finished, or false if it died (status can be NULL)
+// memory the dying code had malloced (rather than b_alloced) is leaked
+#define DATA_TRY(status, code...) ({ \
+    struct data_status _local_status, *_status = (status); \
+    struct data_try _try; \
+    volatile bool _ok = false; \
+    data_try_push(&_try, _status ? _status : &_local_status); \
+    if(!setjmp(_try.jmp)) { \
+        code; \
+        data_try_pop(&_try); \
+        _ok = true; \
+    } \
+    (bool) _ok; \
+})
+
 struct binary;
 #define ADDR64 1
 #if ADDR64
@@ -54,7 +136,13 @@ typedef struct { void *start; size_t size; } prange_t;
 
 __BEGIN_DECLS
 
+// copies range into newsize bytes of fresh writable memory, at offset
+// if range is file-backed, the copy may share the file's pages copy-on-write (vm_remap on Darwin, a
+// MAP_PRIVATE mapping of the same file on Linux) rather than being anonymous memory, so just like the
+// original mapping, touching a page the file no longer covers after it's been truncated raises SIGBUS
 prange_t pdup(prange_t range, size_t newsize, size_t offset);
+// for things from pdup and load_file
+void punmap(prange_t range);
 
 bool is_valid_range(prange_t range);
 
@@ -63,10 +151,60 @@ prange_t parse_hex_string(const char *string);
 prange_t load_file(const char *filename, bool rw, mode_t *mode);
 prange_t load_fd(int fd, bool rw);
 
+// flags for load_file_flags and load_fd_flags
+#define LOAD_RW 1
+// fault the whole file in now instead of on first touch (just WILLNEED where there's no MAP_POPULATE)
+#define LOAD_POPULATE 2
+// 2MB-align the mapping and ask for transparent huge pages; worth it for kernelcaches and dyld caches
+#define LOAD_HUGEPAGE 4
+prange_t load_file_flags(const char *filename, int flags, mode_t *mode);
+prange_t load_fd_flags(int fd, int flags);
+
+// access hints; the range is rounded out to pages, and failure is ignored since they're only hints.
+// DONTNEED drops the pages: for our MAP_PRIVATE mappings that means anything written to them
+// (e.g. by b_relocate or inject) is thrown away and the file contents come back, so only use it on
+// ranges that haven't been modified.
+enum prange_advice {
+    ADVISE_NORMAL,
+    ADVISE_SEQUENTIAL,
+    ADVISE_RANDOM,
+    ADVISE_WILLNEED,
+    ADVISE_DONTNEED,
+};
+void prange_advise(prange_t range, enum prange_advice advice);
+// sets bit i of bitmap if the ith page of range (counting from the page range.start is on) is a private
+// copy, i.e. it has been written to since it was mapped; if that can't be told, sets them all
+void prange_private_pages(prange_t range, uint8_t *bitmap);
+
 void store_file(prange_t range, const char *filename, mode_t mode);
 
+// what store_file_incremental remembers about the last store; start zeroed
+struct data_store_state {
+    bool valid;
+    void *start;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_ns;
+    unsigned long epoch;
+};
+// if filename is unchanged since the last store with this state (or range is a private mapping of
+// all of it), only writes the pages modified since, using soft-dirty bits where the kernel has them
+// and otherwise every page that's a private copy.  anything else is a full store_file.
+// returns true if it managed an incremental store.  the range mustn't be written to meanwhile.
+bool store_file_incremental(prange_t range, const char *filename, mode_t mode, struct data_store_state *state);
+
 addr_t parse_hex_addr(const char *string);
 
+// worker pool; 0 means one thread per CPU, 1 (the default) keeps everything on the calling thread
+void data_set_threads(unsigned int nthreads);
+unsigned int data_threads();
+// runs func(ctx, 0..count-1) across the pool and returns when all are done; func must not die()
+void data_parallel(unsigned int count, void (*func)(void *ctx, unsigned int i), void *ctx);
+
+void data_try_push(struct data_try *point, struct data_status *status);
+void data_try_pop(struct data_try *point);
+
 __attribute__((noreturn, format(printf, 1, 2)))
 void _die(const char *fmt, ...);
 
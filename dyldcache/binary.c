@@ -4,18 +4,18 @@
 
 #define downcast(val, typ) ({ typeof(val) v = (val); typ t = (typ) v; if(t != v) die("out of range %s", #val); t; })
 
-void b_prange_load_dyldcache(struct binary *binary, prange_t pr, const char *name) {
+// the header and mappings stay pinned, since we keep pointers to them
+static void load_dyldcache(struct binary *binary, uint64_t size, const char *name) {
 #define _arg name
 
     binary->valid = true;
     binary->pointer_size = 4;
-    binary->dyld = calloc(1, sizeof(*binary->dyld));
-    binary->valid_range = pr;
+    binary->dyld = b_alloc(binary, sizeof(*binary->dyld));
 
-    if(pr.size < sizeof(*binary->dyld->hdr)) {
+    if(size < sizeof(*binary->dyld->hdr)) {
         die("truncated (no room for dyld cache header)");
     }
-    binary->dyld->hdr = pr.start;
+    binary->dyld->hdr = b_window_pin(binary, (range_t) {binary, 0, sizeof(*binary->dyld->hdr)});
 
     if(memcmp(binary->dyld->hdr->magic, "dyld_", 5)) {
         die("not a dyld cache");
@@ -35,8 +35,8 @@ void b_prange_load_dyldcache(struct binary *binary, prange_t pr, const char *nam
         die("insane mapping count: %u", binary->dyld->hdr->mappingCount);
     }
     binary->nsegments = binary->dyld->hdr->mappingCount;
-    binary->segments = malloc(sizeof(*binary->segments) * binary->nsegments);
-    struct shared_file_mapping_np *mappings = rangeconv_off((range_t) {binary, binary->dyld->hdr->mappingOffset, binary->dyld->hdr->mappingCount * sizeof(struct shared_file_mapping_np)}, MUST_FIND).start;
+    binary->segments = b_alloc(binary, sizeof(*binary->segments) * binary->nsegments);
+    struct shared_file_mapping_np *mappings = b_window_pin(binary, (range_t) {binary, binary->dyld->hdr->mappingOffset, binary->dyld->hdr->mappingCount * sizeof(struct shared_file_mapping_np)});
     for(uint32_t i = 0; i < binary->dyld->hdr->mappingCount; i++) {
         struct data_segment *seg = &binary->segments[i];
         seg->vm_range.binary = seg->file_range.binary = binary;
@@ -45,21 +45,39 @@ void b_prange_load_dyldcache(struct binary *binary, prange_t pr, const char *nam
         seg->file_range.start = downcast(mappings[i].sfm_file_offset, addr_t);
         seg->file_range.size = seg->vm_range.size = downcast(mappings[i].sfm_size, size_t);
     }
+    b_index_segments(binary);
 
     
     for(unsigned int i = 0; i < binary->dyld->nmappings; i++) {
         struct shared_file_mapping_np *mapping = &binary->dyld->mappings[i];
-        if(mapping->sfm_file_offset >= pr.size || mapping->sfm_size > pr.size - mapping->sfm_file_offset) {
+        if(mapping->sfm_file_offset >= size || mapping->sfm_size > size - mapping->sfm_file_offset) {
             die("truncated (no room for dyld cache mapping %d)", i);
         }
     }
 #undef _arg
 }
 
-void b_dyldcache_load_macho(const struct binary *binary, const char *filename, struct binary *out) {
+void b_prange_load_dyldcache(struct binary *binary, prange_t pr, const char *name) {
+    binary->valid_range = pr;
+    load_dyldcache(binary, pr.size, name);
+}
+
+bool b_try_prange_load_dyldcache(struct binary *binary, prange_t pr, const char *name, struct data_status *status) {
+    if(DATA_TRY(status, b_prange_load_dyldcache(binary, pr, name))) {
+        return true;
+    }
+    b_destroy(binary);
+    return false;
+}
+
+void b_dyldcache_load_macho_noreexports(const struct binary *binary, const char *filename, struct binary *out) {
     if(binary == out) {
         die("uck");
     }
+    if(binary->windows) {
+        // images keep pointers all over the cache
+        die("can't load images out of a windowed dyld cache");
+    }
 
     if(binary->dyld->hdr->imagesCount > 1000) {
         die("insane images count");
@@ -74,29 +92,58 @@ void b_dyldcache_load_macho(const struct binary *binary, const char *filename, s
         }
         // we found it
         b_prange_load_macho(out, binary->valid_range,range_to_off_range((range_t) {binary, (uint32_t) info[i].address, 0}, MUST_FIND).start, filename);
-        
-        // look for reexports (maybe blowing the stack)
-        int count = 0;
+        return;
+    }
+    die("couldn't find %s in dyld cache", filename);
+}
+
+void b_dyldcache_load_macho(const struct binary *binary, const char *filename, struct binary *out) {
+    b_dyldcache_load_macho_noreexports(binary, filename, out);
+
+    // look for reexports (maybe blowing the stack)
+    int count = 0;
+    CMD_ITERATE(b_mach_hdr(out), cmd) {
+        if(cmd->cmd == LC_REEXPORT_DYLIB) count++;
+    }
+    if(count > 0 && count < 1000) {
+        out->nreexports = (unsigned int) count;
+        struct binary *p = out->reexports = b_alloc(out, out->nreexports * sizeof(struct binary));
         CMD_ITERATE(b_mach_hdr(out), cmd) {
-            if(cmd->cmd == LC_REEXPORT_DYLIB) count++;
-        }
-        if(count > 0 && count < 1000) {
-            out->nreexports = (unsigned int) count;
-            struct binary *p = out->reexports = malloc(out->nreexports * sizeof(struct binary));
-            CMD_ITERATE(b_mach_hdr(out), cmd) {
-                if(cmd->cmd == LC_REEXPORT_DYLIB) {
-                    const char *name = convert_lc_str(cmd, ((struct dylib_command *) cmd)->dylib.name.offset);
-                    b_dyldcache_load_macho(binary, name, p);
-                    p++;
-                }
+            if(cmd->cmd == LC_REEXPORT_DYLIB) {
+                const char *name = convert_lc_str(cmd, ((struct dylib_command *) cmd)->dylib.name.offset);
+                b_init(p);
+                b_dyldcache_load_macho(binary, name, p);
+                p++;
             }
         }
-
-        return;
     }
-    die("couldn't find %s in dyld cache", filename);
 }
 
 void b_load_dyldcache(struct binary *binary, const char *filename) {
-    return b_prange_load_dyldcache(binary, load_file(filename, true, NULL), filename);
+    prange_t pr = load_file(filename, true, NULL);
+    b_own_mapping(binary, pr);
+    b_prange_load_dyldcache(binary, pr, filename);
+}
+
+void b_load_dyldcache_windowed(struct binary *binary, const char *filename, size_t budget) {
+#define _arg filename
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) {
+        edie("could not open");
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if(size == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        edie("could not seek");
+    }
+    struct data_status status;
+    bool ok = DATA_TRY(&status, b_open_windows(binary, fd, budget));
+    close(fd);
+    if(!ok) {
+        _die("%s\n", status.message);
+    }
+    load_dyldcache(binary, (uint64_t) size, filename);
+#undef _arg
 }
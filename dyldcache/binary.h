@@ -12,9 +12,15 @@ struct dyldcache_binary {
 __BEGIN_DECLS
 
 void b_prange_load_dyldcache(struct binary *binary, prange_t range, const char *name);
+// on failure, the binary is b_destroyed (range still belongs to the caller)
+bool b_try_prange_load_dyldcache(struct binary *binary, prange_t range, const char *name, struct data_status *status);
 void b_dyldcache_load_macho(const struct binary *binary, const char *filename, struct binary *out);
+// just the image; nreexports is left at 0
+void b_dyldcache_load_macho_noreexports(const struct binary *binary, const char *filename, struct binary *out);
 
 void b_load_dyldcache(struct binary *binary, const char *filename);
+// maps at most about budget bytes of the cache at a time; see b_open_windows.  can't b_dyldcache_load_macho from it
+void b_load_dyldcache_windowed(struct binary *binary, const char *filename, size_t budget);
 
 
 __END_DECLS
@@ -1,109 +1,289 @@
 #include "find.h"
 #include "binary.h"
 
-// Various links:
-// http://ridiculousfish.com/blog/archives/2006/05/30/old-age-and-treachery/
-// http://www-igm.univ-mlv.fr/~lecroq/string/tunedbm.html#SECTION00195
-// http://www-igm.univ-mlv.fr/~lecroq/string/node19.html#SECTION00190 (was using this)
+// The search engine: pick the two rarest non-wildcard bytes of the pattern as anchors, compare them against a block of candidate
+// positions at once with vector compares, then verify each surviving candidate against the full pattern under its wildcard mask.
+// Unlike the Horspool loop this used to be, wildcards don't hurt, and there is no limit on pattern length.
 
-static addr_t find_data_raw(range_t range, int16_t *buf, ssize_t pattern_size, size_t offset, int align, int options, const char *name) {
-    int8_t ps = (int8_t) pattern_size;
-    if(ps != pattern_size) {
-        die("pattern too long");
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ >= 5)
+#define FIND_X86_SIMD 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define FIND_NEON_SIMD 1
+#include <arm_neon.h>
+#endif
+
+struct search_plan {
+    const uint8_t *bytes; // wildcards are 0
+    const uint8_t *care; // 0xff for fixed bytes, 0 for wildcards
+    size_t size;
+    size_t a1, a2; // anchor positions
+};
+
+// rough commonness in ARM code and data; anchors should be rare
+static inline int byte_commonness(uint8_t c) {
+    switch(c) {
+    case 0x00: return 6;
+    case 0xff: return 5;
+    case 0xe0 ... 0xef: return 4; // ARM condition codes
+    case 0xf0 ... 0xfe: return 3; // Thumb-2 prefixes
+    case 0x01 ... 0x0f:
+    case 0x20: case 0x2d: case 0x46: case 0x47: case 0x60: case 0x68: case 0xb5: case 0xbd:
+        return 2;
+    default: return 1;
     }
-    // the problem with this is that it is faster to search for everything at once
+}
 
-    // reduce inefficiency
-    for(int pos = pattern_size - 1; pos >= 0; pos--) {
-        if(buf[pos] == -1) {
-            pattern_size--;
-        } else {
-            break;
+// returns the buffer to free
+static uint8_t *make_search_plan(struct search_plan *plan, const int16_t *buf, size_t pattern_size) {
+    uint8_t *bytes = malloc(2 * pattern_size), *care = bytes + pattern_size;
+    int best1 = 100, best2 = 100;
+    plan->a1 = plan->a2 = 0;
+    for(size_t i = 0; i < pattern_size; i++) {
+        if(buf[i] == -1) {
+            bytes[i] = care[i] = 0;
+            continue;
+        }
+        bytes[i] = (uint8_t) buf[i];
+        care[i] = 0xff;
+        int c = byte_commonness(bytes[i]);
+        if(c < best1) {
+            best2 = best1; plan->a2 = plan->a1;
+            best1 = c; plan->a1 = i;
+        } else if(c < best2) {
+            best2 = c; plan->a2 = i;
         }
     }
-    int8_t table[256];
-    for(int c = 0; c < 256; c++) {
-        table[c] = ps;
+    if(best2 == 100) plan->a2 = plan->a1;
+    plan->bytes = bytes;
+    plan->care = care;
+    plan->size = pattern_size;
+    return bytes;
+}
+
+static inline bool verify_scalar(const struct search_plan *plan, const uint8_t *p, size_t i) {
+    for(; i < plan->size; i++) {
+        if((p[i] ^ plan->bytes[i]) & plan->care[i]) return false;
     }
-    for(int8_t pos = 0; pos < ps - 1; pos++) {
-        if(buf[pos] == -1) {
-            // Unfortunately, we can't put any character past being in this position...
-            for(int i = 0; i < 256; i++) {
-                table[i] = ps - pos - 1;
-            }
-        } else {
-            table[buf[pos]] = ps - pos - 1;
+    return true;
+}
+
+// Each scan function returns the first position >= cursor where the whole pattern matches and fits before end, or NULL.
+
+static const uint8_t *scan_scalar(const struct search_plan *plan, const uint8_t *cursor, const uint8_t *end) {
+    if((size_t) (end - cursor) < plan->size) return NULL;
+    const uint8_t *last = end - plan->size;
+    uint8_t c1 = plan->bytes[plan->a1];
+    while(cursor <= last) {
+        const uint8_t *p = memchr(cursor + plan->a1, c1, last - cursor + 1);
+        if(!p) return NULL;
+        p -= plan->a1;
+        if(verify_scalar(plan, p, 0)) return p;
+        cursor = p + 1;
+    }
+    return NULL;
+}
+
+#ifdef FIND_X86_SIMD
+__attribute__((target("sse2")))
+static inline bool verify_sse2(const struct search_plan *plan, const uint8_t *p) {
+    size_t i = 0;
+    for(; i + 16 <= plan->size; i += 16) {
+        __m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (p + i)), _mm_loadu_si128((const __m128i *) (plan->bytes + i)));
+        diff = _mm_and_si128(diff, _mm_loadu_si128((const __m128i *) (plan->care + i)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff) return false;
+    }
+    return verify_scalar(plan, p, i);
+}
+
+__attribute__((target("sse2")))
+static const uint8_t *scan_sse2(const struct search_plan *plan, const uint8_t *cursor, const uint8_t *end) {
+    if((size_t) (end - cursor) < plan->size) return NULL;
+    const uint8_t *last = end - plan->size;
+    __m128i c1 = _mm_set1_epi8((char) plan->bytes[plan->a1]), c2 = _mm_set1_epi8((char) plan->bytes[plan->a2]);
+    for(; last - cursor >= 15; cursor += 16) {
+        __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (cursor + plan->a1)), c1);
+        __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (cursor + plan->a2)), c2);
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_and_si128(eq1, eq2));
+        while(mask) {
+            const uint8_t *p = cursor + __builtin_ctz(mask);
+            if(verify_sse2(plan, p)) return p;
+            mask &= mask - 1;
         }
     }
+    return scan_scalar(plan, cursor, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *scan_avx2(const struct search_plan *plan, const uint8_t *cursor, const uint8_t *end) {
+    if((size_t) (end - cursor) < plan->size) return NULL;
+    const uint8_t *last = end - plan->size;
+    __m256i c1 = _mm256_set1_epi8((char) plan->bytes[plan->a1]), c2 = _mm256_set1_epi8((char) plan->bytes[plan->a2]);
+    for(; last - cursor >= 31; cursor += 32) {
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (cursor + plan->a1)), c1);
+        __m256i eq2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (cursor + plan->a2)), c2);
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(eq1, eq2));
+        while(mask) {
+            const uint8_t *p = cursor + __builtin_ctz(mask);
+            if(verify_sse2(plan, p)) return p;
+            mask &= mask - 1;
+        }
+    }
+    return scan_sse2(plan, cursor, end);
+}
+#endif
 
-    // this can't be -1 due to above
-    int8_t shift = table[buf[pattern_size - 1]];
-    table[buf[pattern_size - 1]] = 0;
+#ifdef FIND_NEON_SIMD
+static inline bool verify_neon(const struct search_plan *plan, const uint8_t *p) {
+    size_t i = 0;
+    for(; i + 16 <= plan->size; i += 16) {
+        uint8x16_t diff = vandq_u8(veorq_u8(vld1q_u8(p + i), vld1q_u8(plan->bytes + i)), vld1q_u8(plan->care + i));
+        uint64x2_t d = vreinterpretq_u64_u8(diff);
+        if(vgetq_lane_u64(d, 0) | vgetq_lane_u64(d, 1)) return false;
+    }
+    return verify_scalar(plan, p, i);
+}
+
+static const uint8_t *scan_neon(const struct search_plan *plan, const uint8_t *cursor, const uint8_t *end) {
+    if((size_t) (end - cursor) < plan->size) return NULL;
+    const uint8_t *last = end - plan->size;
+    uint8x16_t c1 = vdupq_n_u8(plan->bytes[plan->a1]), c2 = vdupq_n_u8(plan->bytes[plan->a2]);
+    for(; last - cursor >= 15; cursor += 16) {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(cursor + plan->a1), c1), vceqq_u8(vld1q_u8(cursor + plan->a2), c2));
+        // no movemask on NEON; narrow to 4 bits per byte instead
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while(mask) {
+            int bit = __builtin_ctzll(mask) / 4;
+            if(verify_neon(plan, cursor + bit)) return cursor + bit;
+            mask &= ~(0xfull << (bit * 4));
+        }
+    }
+    return scan_scalar(plan, cursor, end);
+}
+#endif
+
+typedef const uint8_t *(*scan_func_t)(const struct search_plan *plan, const uint8_t *cursor, const uint8_t *end);
+
+static scan_func_t pick_scan_func() {
+#if defined(FIND_X86_SIMD)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return scan_avx2;
+    if(__builtin_cpu_supports("sse2")) return scan_sse2;
+#elif defined(FIND_NEON_SIMD)
+    return scan_neon;
+#endif
+    return scan_scalar;
+}
+
+static inline const uint8_t *search_scan(const struct search_plan *plan, const uint8_t *cursor, const uint8_t *end) {
+    // racing on this is harmless
+    static scan_func_t scan_func;
+    scan_func_t func = data_atomic_load(&scan_func);
+    if(!func) {
+        func = pick_scan_func();
+        data_atomic_store(&scan_func, func);
+    }
+    return func(plan, cursor, end);
+}
+
+// Big ranges are split into chunks for the worker pool.  A chunk owns the match start positions in [lo, lo + chunk_size) and
+// reads pattern size - 1 bytes past that, so every match is seen by exactly one chunk; results are merged in chunk order,
+// which makes the outcome (including what "found multiple times" reports) identical to one serial pass.
+#define SEARCH_CHUNK_MIN (1024 * 1024)
+
+// below this, asking for readahead costs more than the faults it saves
+#define SEARCH_PREFETCH_MIN (1024 * 1024)
+
+static void search_prefetch(prange_t pr) {
+    if(pr.size >= SEARCH_PREFETCH_MIN) {
+        prange_advise(pr, ADVISE_WILLNEED);
+    }
+}
+
+static size_t search_chunk_size(size_t size, unsigned int *nchunks) {
+    unsigned int threads = data_threads();
+    size_t chunk_size = size;
+    if(threads > 1 && size >= 2 * SEARCH_CHUNK_MIN) {
+        chunk_size = max(size / (4 * threads), SEARCH_CHUNK_MIN);
+    }
+    *nchunks = chunk_size ? (unsigned int) ((size + chunk_size - 1) / chunk_size) : 1;
+    if(!*nchunks) *nchunks = 1;
+    return chunk_size;
+}
+
+struct data_search {
+    const struct search_plan *plan;
+    const uint8_t *start, *end;
+    size_t chunk_size;
+    addr_t base;
+    int align;
+    unsigned int max_hits;
+    struct data_search_chunk {
+        const uint8_t *hits[2];
+        unsigned int nhits;
+    } *chunks;
+};
+
+static void data_search_chunk(void *ctx, unsigned int i) {
+    struct data_search *ds = ctx;
+    struct data_search_chunk *chunk = &ds->chunks[i];
+    const uint8_t *lo = ds->start + i * ds->chunk_size;
+    size_t window = ds->chunk_size + ds->plan->size - 1;
+    const uint8_t *hi = (size_t) (ds->end - lo) > window ? lo + window : ds->end;
+    chunk->nhits = 0;
+    for(const uint8_t *cursor = lo; chunk->nhits < ds->max_hits && (cursor = search_scan(ds->plan, cursor, hi)); cursor++) {
+        if(ds->align && ((cursor - ds->start + ds->base) & (ds->align - 1))) {
+            continue;
+        }
+        chunk->hits[chunk->nhits++] = cursor;
+    }
+}
 
-    // now, for each c, let x be the last position in the string, other than the final position, where c might appear, or -1 if it doesn't appear anywhere; table[i] is size - x - 1.
-    // so if we got c but no match, we can skip ahead by table[i]
-    // updated
-    buf += pattern_size - 1;
-    addr_t foundit = 0;
+// returns the number of hits (at most max_hits) stored in hits
+static unsigned int search_range(range_t range, const struct search_plan *plan, int align, unsigned int max_hits, addr_t *hits) {
     prange_t pr = rangeconv(range, MUST_FIND);
-    uint8_t *start = pr.start + pattern_size - 1;
-    uint8_t *end = pr.start + pr.size;
-    uint8_t *cutoff = end - 400; // arbitrary
-    uint8_t *cursor = start;
-
-#define GUTS(keep_going) \
-        { \
-            for(int i = 0; i >= (-pattern_size + 1); i--) { \
-                if(buf[i] != -1 && cursor[i] != buf[i]) { \
-                    /* Not a match */ \
-                    goto keep_going; \
-                } \
-            } \
-            /* Whoa, we found it */ \
-            addr_t new_match = cursor - start + range.start; \
-            if(align && (new_match & (align - 1))) { \
-                /* Just kidding. */ \
-                goto keep_going; \
-            } \
-            if(foundit) { \
-                die("found [%s] multiple times in range: first at %08llx then at %08llx", name, (uint64_t) foundit, (uint64_t) new_match); \
-            } \
-            foundit = new_match; \
-            if(align) { \
-                goto done; \
-            } \
-        } \
-        /* otherwise, keep searching to make sure we won't find it again */ \
-        keep_going: \
-        cursor += shift;
-    
-    uint8_t jump;
-
-    while(1) {
-        if(cursor >= cutoff) break;
-        do {
-            jump = table[*cursor];
-            cursor += jump;
-            jump = table[*cursor];
-            cursor += jump;
-            jump = table[*cursor];
-            cursor += jump;
-            if(cursor >= end) goto done;
-        } while(jump);
-        GUTS(lbl1)
-    }
-    if(cursor >= end) goto done;
-    while(1) {
-        do {
-            jump = table[*cursor];
-            cursor += jump;
-            if(cursor >= end) goto done;
-        } while(jump);
-        GUTS(lbl2)
-    }
-    done:
-    if(foundit) {
-        return foundit + offset;
+    search_prefetch(pr);
+    unsigned int nchunks;
+    struct data_search ds = {
+        .plan = plan,
+        .start = pr.start,
+        .end = (const uint8_t *) pr.start + pr.size,
+        .chunk_size = search_chunk_size(pr.size, &nchunks),
+        .base = range.start,
+        .align = align,
+        .max_hits = max_hits,
+    };
+    autofree struct data_search_chunk *chunks = ds.chunks = malloc(nchunks * sizeof(*chunks));
+    data_parallel(nchunks, data_search_chunk, &ds);
+
+    unsigned int nhits = 0;
+    for(unsigned int i = 0; i < nchunks; i++) {
+        for(unsigned int j = 0; j < chunks[i].nhits && nhits < max_hits; j++) {
+            hits[nhits++] = chunks[i].hits[j] - ds.start + range.start;
+        }
+    }
+    return nhits;
+}
+
+static addr_t find_data_raw(range_t range, int16_t *buf, ssize_t pattern_size, size_t offset, int align, int options, const char *name) {
+    // reduce inefficiency
+    while(pattern_size > 0 && buf[pattern_size - 1] == -1) {
+        pattern_size--;
+    }
+    if(pattern_size <= 0) {
+        die("pattern [%s] is empty", name);
+    }
+    struct search_plan plan;
+    autofree uint8_t *plan_buf = make_search_plan(&plan, buf, (size_t) pattern_size);
+
+    // with align, the first aligned match wins; otherwise, keep searching to make sure we won't find it again
+    addr_t hits[2];
+    unsigned int nhits = search_range(range, &plan, align, align ? 1 : 2, hits);
+    if(nhits == 2) {
+        die("found [%s] multiple times in range: first at %08llx then at %08llx", name, (uint64_t) hits[0], (uint64_t) hits[1]);
+    }
+    if(nhits) {
+        return hits[0] + offset;
     } else if(options & MUST_FIND) {
         die("didn't find [%s] in range (%08llx, %zx)", name, (uint64_t) range.start, range.size);
     } else {
@@ -114,7 +294,9 @@ static addr_t find_data_raw(range_t range, int16_t *buf, ssize_t pattern_size, s
 static void parse_pattern(const char *to_find, int16_t buf[128], ssize_t *pattern_size, ssize_t *offset) {
     *pattern_size = 0;
     *offset = 0;
-    autofree char *to_find_ = strdup(to_find);
+    // strsep moves to_find_, so free the original
+    autofree char *copy = strdup(to_find);
+    char *to_find_ = copy;
     while(to_find_) {
         char *bit = strsep(&to_find_, " ");
         if(!strcmp(bit, "-")) {
@@ -167,13 +349,15 @@ addr_t find_bytes(range_t range, const char *bytes, size_t len, int align, int o
     return result;
 }
 addr_t find_int32(range_t range, uint32_t number, int options) {
-    prange_t pr = rangeconv(range, MUST_FIND);
-    char *start = pr.start;
-    char *end = pr.start + pr.size;
-    for(char *p = start; p + 4 <= end; p++) {
-        if(*((uint32_t *)p) == number) {
-            return p - start + range.start;
-        }
+    int16_t buf[4];
+    for(int i = 0; i < 4; i++) {
+        buf[i] = (uint8_t) (number >> (8 * i));
+    }
+    struct search_plan plan;
+    autofree uint8_t *plan_buf = make_search_plan(&plan, buf, 4);
+    addr_t hit;
+    if(search_range(range, &plan, 0, 1, &hit)) {
+        return hit;
     }
     if(options & MUST_FIND) {
         die("didn't find %08x in range", number);
@@ -182,6 +366,234 @@ addr_t find_int32(range_t range, uint32_t number, int options) {
     }
 }
 
+// find_int32s/find_int64s: the first occurrence of each of a set of values, in one pass.  Small sets compare every byte phase
+// against each value at once with vector broadcast compares; bigger ones hash each position and probe a table behind a
+// bloom filter.
+#define INT_SET_SMALL 4
+#define INT_SET_EMPTY 0xffffffff
+
+struct int_set {
+    unsigned int width;
+    const uint64_t *values; // distinct
+    size_t count;
+    // hashed
+    uint64_t *keys;
+    uint32_t *idx;
+    size_t mask;
+    uint64_t bloom[1024];
+
+    const uint8_t *start, *end;
+    size_t chunk_size;
+    const uint8_t **hits; // per chunk, per value
+};
+
+static inline uint32_t int_set_hash(uint64_t v) {
+    return (uint32_t) ((v * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+static inline uint64_t int_set_load(const uint8_t *p, unsigned int width) {
+    if(width == 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    } else {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+}
+
+static const uint8_t *int_set_scan_hashed(const struct int_set *set, const uint8_t *lo, const uint8_t *hi, const uint8_t **hits, size_t left) {
+    const uint8_t *p = lo;
+    for(; left && (size_t) (hi - p) >= set->width; p++) {
+        uint64_t v = int_set_load(p, set->width);
+        uint32_t h = int_set_hash(v);
+        if(!(set->bloom[(h >> 16) & 1023] & (1ull << (h & 63)))) continue;
+        for(size_t j = h & set->mask; set->idx[j] != INT_SET_EMPTY; j = (j + 1) & set->mask) {
+            if(set->keys[j] == v) {
+                if(!hits[set->idx[j]]) {
+                    hits[set->idx[j]] = p;
+                    left--;
+                }
+                break;
+            }
+        }
+    }
+    return p;
+}
+
+#ifdef FIND_X86_SIMD
+// spread 4 bits to every 4th bit
+static const uint16_t spread4[16] = {
+    0x0000, 0x0001, 0x0010, 0x0011, 0x0100, 0x0101, 0x0110, 0x0111,
+    0x1000, 0x1001, 0x1010, 0x1011, 0x1100, 0x1101, 0x1110, 0x1111,
+};
+
+// returns where it stopped; the caller finishes the tail
+__attribute__((target("sse2")))
+static const uint8_t *int_set_scan_sse2(const struct int_set *set, const uint8_t *lo, const uint8_t *hi, const uint8_t **hits, size_t left) {
+    __m128i bc[INT_SET_SMALL];
+    for(size_t i = 0; i < set->count; i++) {
+        bc[i] = set->width == 4 ? _mm_set1_epi32((int) set->values[i]) : _mm_set1_epi64x((long long) set->values[i]);
+    }
+    const uint8_t *p = lo;
+    if(set->width == 4) {
+        // loads at p..p+3 cover positions p..p+15 as 4-byte lanes
+        for(; left && hi - p >= 19; p += 16) {
+            __m128i v[4];
+            __m128i any = _mm_setzero_si128();
+            for(int k = 0; k < 4; k++) {
+                v[k] = _mm_loadu_si128((const __m128i *) (p + k));
+                for(size_t i = 0; i < set->count; i++) {
+                    any = _mm_or_si128(any, _mm_cmpeq_epi32(v[k], bc[i]));
+                }
+            }
+            if(!_mm_movemask_epi8(any)) continue;
+            for(size_t i = 0; i < set->count; i++) {
+                if(hits[i]) continue;
+                unsigned int mask = 0;
+                for(int k = 0; k < 4; k++) {
+                    mask |= (unsigned int) spread4[_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v[k], bc[i])))] << k;
+                }
+                if(mask) {
+                    hits[i] = p + __builtin_ctz(mask);
+                    left--;
+                }
+            }
+        }
+    } else {
+        // loads at p..p+7 cover positions p..p+15 as 8-byte lanes; SSE2 has no 64-bit compare, so AND the halves
+        for(; left && hi - p >= 23; p += 16) {
+            __m128i v[8];
+            // cheap reject on the 32-bit halves first
+            __m128i any = _mm_setzero_si128();
+            for(int k = 0; k < 8; k++) {
+                v[k] = _mm_loadu_si128((const __m128i *) (p + k));
+                for(size_t i = 0; i < set->count; i++) {
+                    any = _mm_or_si128(any, _mm_cmpeq_epi32(v[k], bc[i]));
+                }
+            }
+            if(!_mm_movemask_epi8(any)) continue;
+            for(size_t i = 0; i < set->count; i++) {
+                if(hits[i]) continue;
+                unsigned int mask = 0;
+                for(int k = 0; k < 8; k++) {
+                    __m128i eq = _mm_cmpeq_epi32(v[k], bc[i]);
+                    eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+                    unsigned int m = (unsigned int) _mm_movemask_pd(_mm_castsi128_pd(eq));
+                    mask |= ((m & 1) | ((m & 2) << 7)) << k;
+                }
+                if(mask) {
+                    hits[i] = p + __builtin_ctz(mask);
+                    left--;
+                }
+            }
+        }
+    }
+    return p;
+}
+#endif
+
+static void int_set_chunk(void *ctx, unsigned int i) {
+    struct int_set *set = ctx;
+    const uint8_t **hits = set->hits + (size_t) i * set->count;
+    memset(hits, 0, set->count * sizeof(*hits));
+    const uint8_t *lo = set->start + i * set->chunk_size;
+    size_t window = set->chunk_size + set->width - 1;
+    const uint8_t *hi = (size_t) (set->end - lo) > window ? lo + window : set->end;
+    const uint8_t *p = lo;
+#ifdef FIND_X86_SIMD
+    if(!set->keys && __builtin_cpu_supports("sse2")) {
+        p = int_set_scan_sse2(set, p, hi, hits, set->count);
+    }
+#endif
+    size_t left = 0;
+    for(size_t j = 0; j < set->count; j++) {
+        left += !hits[j];
+    }
+    if(!set->keys) {
+        for(; left && (size_t) (hi - p) >= set->width; p++) {
+            uint64_t v = int_set_load(p, set->width);
+            for(size_t j = 0; j < set->count; j++) {
+                if(!hits[j] && set->values[j] == v) {
+                    hits[j] = p;
+                    left--;
+                }
+            }
+        }
+    } else {
+        int_set_scan_hashed(set, p, hi, hits, left);
+    }
+}
+
+static void find_ints(range_t range, unsigned int width, const uint64_t *numbers, size_t count, addr_t *results, int options) {
+    if(!count) return;
+    // dedupe, so each distinct value is looked for once
+    struct int_set set;
+    memset(&set, 0, sizeof(set));
+    set.width = width;
+    set.mask = 15;
+    while(set.mask < 2 * count) set.mask = set.mask * 2 + 1;
+    autofree uint64_t *keys = malloc((set.mask + 1) * sizeof(uint64_t));
+    autofree uint32_t *idx = malloc((set.mask + 1) * sizeof(uint32_t));
+    autofree uint64_t *values = malloc(count * sizeof(uint64_t));
+    autofree uint32_t *which = malloc(count * sizeof(uint32_t));
+    memset(idx, 0xff, (set.mask + 1) * sizeof(uint32_t));
+    for(size_t i = 0; i < count; i++) {
+        uint64_t v = numbers[i];
+        uint32_t h = int_set_hash(v);
+        size_t j = h & set.mask;
+        while(idx[j] != INT_SET_EMPTY && keys[j] != v) j = (j + 1) & set.mask;
+        if(idx[j] == INT_SET_EMPTY) {
+            keys[j] = v;
+            idx[j] = (uint32_t) set.count;
+            values[set.count++] = v;
+            set.bloom[(h >> 16) & 1023] |= 1ull << (h & 63);
+        }
+        which[i] = idx[j];
+    }
+    set.values = values;
+    if(set.count > INT_SET_SMALL) {
+        set.keys = keys;
+        set.idx = idx;
+    }
+
+    prange_t pr = rangeconv(range, MUST_FIND);
+    search_prefetch(pr);
+    unsigned int nchunks;
+    set.start = pr.start;
+    set.end = set.start + pr.size;
+    set.chunk_size = search_chunk_size(pr.size, &nchunks);
+    autofree const uint8_t **hits = set.hits = malloc((size_t) nchunks * set.count * sizeof(*hits));
+    data_parallel(nchunks, int_set_chunk, &set);
+
+    for(size_t i = 0; i < count; i++) {
+        results[i] = 0;
+        for(unsigned int c = 0; c < nchunks; c++) {
+            const uint8_t *hit = hits[(size_t) c * set.count + which[i]];
+            if(hit) {
+                results[i] = hit - set.start + range.start;
+                break;
+            }
+        }
+        if(!results[i] && (options & MUST_FIND)) {
+            die("didn't find %0*llx in range", 2 * width, (unsigned long long) numbers[i]);
+        }
+    }
+}
+
+void find_int32s(range_t range, const uint32_t *numbers, size_t count, addr_t *results, int options) {
+    autofree uint64_t *wide = malloc((count ? count : 1) * sizeof(uint64_t));
+    for(size_t i = 0; i < count; i++) {
+        wide[i] = numbers[i];
+    }
+    find_ints(range, 4, wide, count, results, options);
+}
+
+void find_int64s(range_t range, const uint64_t *numbers, size_t count, addr_t *results, int options) {
+    find_ints(range, 8, numbers, count, results, options);
+}
+
 // search for push {..., lr}; add r7, sp, ...
 // if is_thumb = 2, then search for both thumb and arm variants
 addr_t find_bof(range_t range, addr_t eof, int is_thumb) {
@@ -302,16 +714,48 @@ find_anywhere_func(string, (const char *string, int align), (string, align))
 find_anywhere_func(bytes, (const char *bytes, size_t len, int align), (bytes, len, align))
 find_anywhere_func(int32, (uint32_t number), (number))
 
+// findmany: every pattern contributes one keyword (a short run of its fixed bytes) to an Aho-Corasick automaton; one pass over
+// the range reports every keyword hit, and each hit is verified against its whole pattern with the wildcard mask.
+
+#define AC_KEYWORD_MAX 8
+#define AC_NONE 0xffffffff
+
 struct pattern {
     int16_t buf[128];
     ssize_t pattern_size, offset;
     const char *name;
     addr_t *result;
+
+    struct search_plan plan;
+    uint8_t *plan_buf;
+    size_t kw_start, kw_len;
+    uint32_t next_out; // next pattern with the same keyword state
+    bool found;
+};
+
+struct ac_state {
+    uint32_t fail;
+    uint32_t out; // first pattern whose keyword ends here
+    uint32_t dict; // nearest state down the fail chain with output, or 0
+    uint32_t edges, nedges; // into edge_bytes/edge_next, sorted by byte
+};
+
+// States are numbered breadth first, and the first ndense get a full 256-entry DFA row (so scanning random data, which rarely
+// gets past the first couple of levels, is one load per byte); deeper states fall back to edges plus failure links.
+#define AC_DENSE_BYTES (16 * 1024 * 1024)
+#define AC_OUTPUT 0x80000000
+
+struct ac {
+    struct ac_state *states;
+    uint32_t nstates, ndense;
+    uint8_t *edge_bytes;
+    uint32_t *edge_next;
+    uint32_t *delta; // ndense rows; targets with output have AC_OUTPUT set
 };
 
 struct findmany {
     range_t range;
-    int num_patterns;
+    int num_patterns, cap_patterns;
     struct pattern *patterns;
 };
 
@@ -319,162 +763,399 @@ struct findmany *findmany_init(range_t range) {
     struct findmany *fm = malloc(sizeof(*fm));
     fm->range = range;
     fm->num_patterns = 0;
+    fm->cap_patterns = 0;
     fm->patterns = NULL;
     return fm;
 }
 
+// the rarest window of up to AC_KEYWORD_MAX fixed bytes, preferring longer ones
+static void pick_keyword(struct pattern *pat) {
+    size_t best_start = 0, best_len = 0;
+    int best_score = 0;
+    for(size_t i = 0; i < (size_t) pat->pattern_size; ) {
+        if(pat->buf[i] == -1) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while(j < (size_t) pat->pattern_size && pat->buf[j] != -1) j++;
+        size_t len = min(j - i, AC_KEYWORD_MAX);
+        for(size_t k = i; k + len <= j; k++) {
+            int score = 0;
+            for(size_t l = k; l < k + len; l++) {
+                score += byte_commonness((uint8_t) pat->buf[l]);
+            }
+            if(len > best_len || (len == best_len && score < best_score)) {
+                best_start = k;
+                best_len = len;
+                best_score = score;
+            }
+        }
+        i = j;
+    }
+    pat->kw_start = best_start;
+    pat->kw_len = best_len;
+}
+
 void findmany_add(addr_t *result, struct findmany *fm, const char *to_find) {
-    if(fm->num_patterns >= 32) {
-        die("too many patterns");
+    if(fm->num_patterns == fm->cap_patterns) {
+        fm->cap_patterns = fm->cap_patterns ? 2 * fm->cap_patterns : 16;
+        fm->patterns = realloc(fm->patterns, sizeof(struct pattern) * fm->cap_patterns);
     }
-    fm->num_patterns++;
-    fm->patterns = realloc(fm->patterns, sizeof(struct pattern) * fm->num_patterns);
-    struct pattern *pat = &fm->patterns[fm->num_patterns - 1];
+    struct pattern *pat = &fm->patterns[fm->num_patterns++];
 
     parse_pattern(to_find, pat->buf, &pat->pattern_size, &pat->offset);
+    while(pat->pattern_size > 0 && pat->buf[pat->pattern_size - 1] == -1) {
+        pat->pattern_size--;
+    }
+    if(pat->pattern_size <= 0) {
+        die("pattern [%s] is empty", to_find);
+    }
+    pat->plan_buf = make_search_plan(&pat->plan, pat->buf, (size_t) pat->pattern_size);
+    pick_keyword(pat);
     pat->name = to_find;
     pat->result = result;
+    pat->found = false;
     *result = 0;
 }
 
-struct node {
-    uint16_t next[16];
-    uint32_t terminates;
+struct ac_edge {
+    uint32_t parent;
+    uint8_t byte;
+    uint32_t child;
 };
 
-struct node2 {
-    uint16_t next[16];
-};
+static int ac_edge_cmp(const void *a, const void *b) {
+    const struct ac_edge *x = a, *y = b;
+    if(x->parent != y->parent) return x->parent < y->parent ? -1 : 1;
+    return (int) x->byte - (int) y->byte;
+}
 
-struct findmany2 {
-    struct node *nodes;
-    uint8_t *index_paths;
-    uint16_t node_count;
-    struct node2 *nodes2;
-    uint16_t node2_count;
-};
+static inline uint32_t ac_hash(uint64_t key) {
+    key *= 0x9e3779b97f4a7c15ull;
+    return (uint32_t) (key >> 32);
+}
 
-static inline int find_or_create(void **restrict array, void *restrict cmp, uint16_t *restrict num_items, int item_size, uint16_t *restrict node) {
-    char *p = *array;
-    for(int j = 0; j < *num_items; j++) {
-        if(!memcmp(p, cmp, item_size)) {
-            *node = j;
-            return false;
-        }
-        p += item_size;
-    }
-    if(*num_items == 65535) {
-        die("welp");
+static inline uint32_t ac_child(const struct ac *ac, uint32_t state, uint8_t c) {
+    const struct ac_state *st = &ac->states[state];
+    const uint8_t *bytes = ac->edge_bytes + st->edges;
+    for(uint32_t i = 0; i < st->nedges; i++) {
+        if(bytes[i] == c) return ac->edge_next[st->edges + i];
+        if(bytes[i] > c) break;
     }
-    *node = *num_items;
-    *array = realloc(*array, ++*num_items * item_size);
-    memcpy(*array + *node * item_size, cmp, item_size);
-    return true;
+    return 0;
 }
 
-static uint16_t findmany_recurse(const struct findmany *restrict fm, struct findmany2 *restrict fm2, uint8_t *restrict cur_index_path) {
-    // this part is inefficient
-    uint16_t node;
-    if(!find_or_create((void **) &fm2->index_paths, cur_index_path, &fm2->node_count, fm->num_patterns, &node)) {
-        // it found an existing node
-        return node;
-    }
-    /*
-    printf("findmany_recurse: created node %d with cur_index_path = ", node);
-    for(int p = 0; p < fm->num_patterns; p++) {
-        printf(" %d", (int) cur_index_path[p]);
-    }
-    printf("\n");
-    */
-    memcpy(fm2->index_paths + node * fm->num_patterns, cur_index_path, fm->num_patterns);
+static struct ac *ac_build(struct findmany *fm) {
+    // trie first; (parent, byte) -> child lives in an open-addressed hash table so shared prefixes dedupe in O(1)
+    uint32_t cap_states = 64, nstates = 1;
+    uint32_t *outs = malloc(cap_states * sizeof(uint32_t));
+    outs[0] = AC_NONE;
+    size_t hmask = 1023, hcount = 0;
+    uint64_t *hkeys = malloc((hmask + 1) * sizeof(uint64_t));
+    uint32_t *hvals = malloc((hmask + 1) * sizeof(uint32_t));
+    memset(hkeys, 0xff, (hmask + 1) * sizeof(uint64_t));
+    struct ac_edge *edges = NULL;
+    size_t nedges = 0, cap_edges = 0;
 
-    fm2->nodes = realloc(fm2->nodes, fm2->node_count * sizeof(struct node));
-    struct node *nodep = &fm2->nodes[node];
-    
-    nodep->terminates = 0;
     for(int p = 0; p < fm->num_patterns; p++) {
-        if(cur_index_path[p] == fm->patterns[p].pattern_size) {
-            nodep->terminates |= (1 << p);
-            cur_index_path[p] = 0;
+        struct pattern *pat = &fm->patterns[p];
+        uint32_t state = 0;
+        for(size_t i = pat->kw_start; i < pat->kw_start + pat->kw_len; i++) {
+            uint64_t key = ((uint64_t) state << 8) | (uint8_t) pat->buf[i];
+            size_t h = ac_hash(key) & hmask;
+            while(hkeys[h] != key && hkeys[h] != ~0ull) h = (h + 1) & hmask;
+            if(hkeys[h] == key) {
+                state = hvals[h];
+                continue;
+            }
+            if(nstates == AC_OUTPUT) {
+                die("too many states");
+            }
+            if(nstates == cap_states) {
+                cap_states *= 2;
+                outs = realloc(outs, cap_states * sizeof(uint32_t));
+            }
+            outs[nstates] = AC_NONE;
+            hkeys[h] = key;
+            hvals[h] = nstates;
+            if(nedges == cap_edges) {
+                cap_edges = cap_edges ? 2 * cap_edges : 256;
+                edges = realloc(edges, cap_edges * sizeof(*edges));
+            }
+            edges[nedges++] = (struct ac_edge) {state, (uint8_t) pat->buf[i], nstates};
+            state = nstates++;
+            if(++hcount * 2 > hmask) {
+                // grow and rehash
+                size_t nmask = hmask * 2 + 1;
+                uint64_t *nkeys = malloc((nmask + 1) * sizeof(uint64_t));
+                uint32_t *nvals = malloc((nmask + 1) * sizeof(uint32_t));
+                memset(nkeys, 0xff, (nmask + 1) * sizeof(uint64_t));
+                for(size_t j = 0; j <= hmask; j++) {
+                    if(hkeys[j] == ~0ull) continue;
+                    size_t k = ac_hash(hkeys[j]) & nmask;
+                    while(nkeys[k] != ~0ull) k = (k + 1) & nmask;
+                    nkeys[k] = hkeys[j];
+                    nvals[k] = hvals[j];
+                }
+                free(hkeys);
+                free(hvals);
+                hkeys = nkeys;
+                hvals = nvals;
+                hmask = nmask;
+            }
         }
+        pat->next_out = outs[state];
+        outs[state] = (uint32_t) p;
     }
+    free(hkeys);
+    free(hvals);
 
-    autofree uint8_t *new_index_path = malloc(fm->num_patterns);
-    for(uint8_t hi = 0; hi < 16; hi++) {
-        struct node2 n2;
-        for(uint8_t lo = 0; lo < 16; lo++) {
-            uint8_t chr = hi * 16 + lo;
+    // renumber breadth first: children are created after their parents, so sorting the edges by parent gives each state's
+    // children in one run, and a BFS over those runs gives the new numbering
+    qsort(edges, nedges, sizeof(*edges), ac_edge_cmp);
+    autofree uint32_t *first_edge = malloc((nstates + 1) * sizeof(uint32_t));
+    for(uint32_t i = 0, e = 0; i <= nstates; i++) {
+        while(e < nedges && edges[e].parent < i) e++;
+        first_edge[i] = (uint32_t) e;
+    }
+    autofree uint32_t *order = malloc(nstates * sizeof(uint32_t));
+    autofree uint32_t *newid = malloc(nstates * sizeof(uint32_t));
+    uint32_t qtail = 0;
+    order[qtail++] = 0;
+    for(uint32_t qhead = 0; qhead < qtail; qhead++) {
+        uint32_t s = order[qhead];
+        newid[s] = qhead;
+        for(uint32_t e = first_edge[s]; e < first_edge[s + 1]; e++) {
+            order[qtail++] = edges[e].child;
+        }
+    }
 
-            uint8_t orr = 0; // hack - a lot will point to 0
+    struct ac *ac = calloc(1, sizeof(*ac));
+    ac->nstates = nstates;
+    ac->states = calloc(nstates, sizeof(struct ac_state));
+    ac->edge_bytes = malloc(nedges ? nedges : 1);
+    ac->edge_next = malloc((nedges ? nedges : 1) * sizeof(uint32_t));
+    uint32_t e = 0;
+    for(uint32_t n = 0; n < nstates; n++) {
+        uint32_t s = order[n];
+        struct ac_state *st = &ac->states[n];
+        st->out = outs[s];
+        st->edges = e;
+        st->nedges = first_edge[s + 1] - first_edge[s];
+        // already sorted by byte
+        for(uint32_t i = first_edge[s]; i < first_edge[s + 1]; i++, e++) {
+            ac->edge_bytes[e] = edges[i].byte;
+            ac->edge_next[e] = newid[edges[i].child];
+        }
+    }
+    free(edges);
+    free(outs);
 
-            for(int p = 0; p < fm->num_patterns; p++) {
-                uint8_t idx = cur_index_path[p];
-                int16_t comp = fm->patterns[p].buf[idx];
-                if(comp == -1 || comp == chr) {
-                    idx++;
-                } else {
-                    idx = 0;    
-                }
-                new_index_path[p] = idx;
-                orr |= idx;
+    // failure links and DFA rows, breadth first (which is now just numerical order)
+    ac->ndense = (uint32_t) min((size_t) nstates, AC_DENSE_BYTES / (256 * sizeof(uint32_t)));
+    ac->delta = malloc((size_t) ac->ndense * 256 * sizeof(uint32_t));
+    for(uint32_t s = 0; s < nstates; s++) {
+        struct ac_state *st = &ac->states[s];
+        for(uint32_t i = 0; i < st->nedges; i++) {
+            uint8_t c = ac->edge_bytes[st->edges + i];
+            uint32_t t = ac->edge_next[st->edges + i];
+            uint32_t f = st->fail, g = 0;
+            if(s) {
+                // the fail chain only ever goes shallower, so it reaches a state with a row quickly
+                while(f >= ac->ndense && !(g = ac_child(ac, f, c))) f = ac->states[f].fail;
+                if(f < ac->ndense) g = ac->delta[f * 256 + c] & ~AC_OUTPUT;
+            }
+            struct ac_state *tt = &ac->states[t];
+            tt->fail = g;
+            tt->dict = ac->states[g].out != AC_NONE ? g : ac->states[g].dict;
+        }
+        if(s < ac->ndense) {
+            uint32_t *row = &ac->delta[s * 256];
+            if(s) {
+                memcpy(row, &ac->delta[st->fail * 256], 256 * sizeof(uint32_t));
+            } else {
+                memset(row, 0, 256 * sizeof(uint32_t));
+            }
+            for(uint32_t i = 0; i < st->nedges; i++) {
+                uint32_t t = ac->edge_next[st->edges + i];
+                const struct ac_state *tt = &ac->states[t];
+                row[ac->edge_bytes[st->edges + i]] = t | (tt->out != AC_NONE || tt->dict ? AC_OUTPUT : 0);
             }
+        }
+    }
+    return ac;
+}
+
+static void ac_free(struct ac *ac) {
+    free(ac->states);
+    free(ac->edge_bytes);
+    free(ac->edge_next);
+    free(ac->delta);
+    free(ac);
+}
 
-            n2.next[lo] = orr ? findmany_recurse(fm, fm2, new_index_path) : 0;
+struct findmany_search {
+    const struct findmany *fm;
+    const struct ac *ac;
+    const uint8_t *start, *end;
+    size_t chunk_size, max_size;
+    // per chunk, per pattern
+    uint8_t *nhits;
+    const uint8_t **hits;
+};
+
+static inline void ac_report(const struct findmany_search *fs, uint32_t p, const uint8_t *ptr, const uint8_t *lo, const uint8_t *owned_end, uint8_t *nhits, const uint8_t **hits) {
+    for(; p != AC_NONE; p = fs->fm->patterns[p].next_out) {
+        const struct pattern *pat = &fs->fm->patterns[p];
+        const uint8_t *match = ptr - (pat->kw_start + pat->kw_len - 1);
+        if(match < lo || match >= owned_end || nhits[p] == 2 || (size_t) (fs->end - match) < (size_t) pat->pattern_size || !verify_scalar(&pat->plan, match, 0)) {
+            continue;
         }
-        nodep = &fm2->nodes[node];
-        find_or_create((void **) &fm2->nodes2, &n2, &fm2->node2_count, sizeof(struct node2), &nodep->next[hi]);
+        hits[2 * p + nhits[p]++] = match;
     }
+}
 
-    //printf("returning node %d\n", node);
-    return node;
+static void findmany_chunk(void *ctx, unsigned int i) {
+    struct findmany_search *fs = ctx;
+    const struct ac *ac = fs->ac;
+    int num_patterns = fs->fm->num_patterns;
+    uint8_t *nhits = fs->nhits + (size_t) i * num_patterns;
+    const uint8_t **hits = fs->hits + (size_t) i * num_patterns * 2;
+    memset(nhits, 0, num_patterns);
+
+    const uint8_t *lo = fs->start + i * fs->chunk_size;
+    const uint8_t *owned_end = (size_t) (fs->end - lo) > fs->chunk_size ? lo + fs->chunk_size : fs->end;
+    size_t window = fs->chunk_size + fs->max_size - 1;
+    const uint8_t *hi = (size_t) (fs->end - lo) > window ? lo + window : fs->end;
+    uint32_t s = 0;
+    for(const uint8_t *ptr = lo; ptr < hi; ptr++) {
+        uint8_t chr = *ptr;
+        uint32_t t;
+        if(__builtin_expect(s >= ac->ndense, 0)) {
+            while(s >= ac->ndense && !(t = ac_child(ac, s, chr))) s = ac->states[s].fail;
+            if(s >= ac->ndense) {
+                s = t;
+                const struct ac_state *st = &ac->states[s];
+                if(st->out == AC_NONE && !st->dict) continue;
+                goto output;
+            }
+        }
+        t = ac->delta[s * 256 + chr];
+        s = t & ~AC_OUTPUT;
+        if(!(t & AC_OUTPUT)) continue;
+        output:;
+        const struct ac_state *st = &ac->states[s];
+        if(st->out != AC_NONE) {
+            ac_report(fs, st->out, ptr, lo, owned_end, nhits, hits);
+        }
+        for(uint32_t d = st->dict; d; d = ac->states[d].dict) {
+            ac_report(fs, ac->states[d].out, ptr, lo, owned_end, nhits, hits);
+        }
+    }
+}
+
+static void findmany_free(struct findmany *fm) {
+    for(int p = 0; p < fm->num_patterns; p++) {
+        free(fm->patterns[p].plan_buf);
+    }
+    free(fm->patterns);
+    free(fm);
 }
 
 void findmany_go(struct findmany *fm) {
-    struct findmany2 fm2;
-    memset(&fm2, 0, sizeof(fm2));
-    autofree uint8_t *cur_index_path = calloc(1, fm->num_patterns);
 #ifdef PROFILING
     clock_t a = clock();
 #endif
-    findmany_recurse(fm, &fm2, cur_index_path);
+    prange_t pr = rangeconv(fm->range, MUST_FIND);
+    search_prefetch(pr);
+    struct ac *ac = ac_build(fm);
 #ifdef PROFILING
     clock_t b = clock();
-    printf("it took %d clocks to prepare the DFA\n", (int) (b - a));
+    printf("it took %d clocks to prepare the automaton (%u states)\n", (int) (b - a), ac->nstates);
 #endif
 
-    prange_t pr = rangeconv(fm->range, MUST_FIND);
-    uint8_t *start = pr.start;
-    struct node *cur = &fm2.nodes[0];
-    for(uint8_t *ptr = start; ptr < start + pr.size; ptr++) {
-        uint8_t chr = *ptr;
-
-        cur = &fm2.nodes[fm2.nodes2[cur->next[chr / 16]].next[chr % 16]];
-        if(cur->terminates) {
-            for(int p = 0, bit = 1; p < fm->num_patterns; p++, bit <<= 1) {
-                if(cur->terminates & bit) {
-                    struct pattern *pat = &fm->patterns[p];
-                    addr_t result = ptr - pat->pattern_size - start + fm->range.start + 1;
-                    if(*pat->result) {
-                        die("found [%s] multiple times in range: first at %08llx then at %08llx", pat->name, (uint64_t) *pat->result, (uint64_t) result);
-                    }
-                    *pat->result = result + pat->offset;
-                }
+    unsigned int nchunks;
+    struct findmany_search fs = {
+        .fm = fm,
+        .ac = ac,
+        .start = pr.start,
+        .end = (const uint8_t *) pr.start + pr.size,
+        .chunk_size = search_chunk_size(pr.size, &nchunks),
+    };
+    for(int p = 0; p < fm->num_patterns; p++) {
+        fs.max_size = max(fs.max_size, (size_t) fm->patterns[p].pattern_size);
+    }
+    uint8_t *nhits = fs.nhits = malloc((size_t) nchunks * fm->num_patterns + 1);
+    const uint8_t **hits = fs.hits = malloc(((size_t) nchunks * fm->num_patterns * 2 + 1) * sizeof(*hits));
+    data_parallel(nchunks, findmany_chunk, &fs);
+    ac_free(ac);
 
+    // merge in chunk order; report the duplicate a serial scan would have run into first, i.e. the one
+    // that ends first (the lower index on a tie)
+    const uint8_t *dup = NULL;
+    int dup_p = 0;
+    for(int p = 0; p < fm->num_patterns; p++) {
+        struct pattern *pat = &fm->patterns[p];
+        const uint8_t *found[2];
+        unsigned int nfound = 0;
+        for(unsigned int i = 0; i < nchunks && nfound < 2; i++) {
+            size_t k = (size_t) i * fm->num_patterns + p;
+            for(unsigned int j = 0; j < nhits[k] && nfound < 2; j++) {
+                found[nfound++] = hits[2 * k + j];
             }
         }
+        if(nfound) {
+            pat->found = true;
+            *pat->result = found[0] - fs.start + fm->range.start + pat->offset;
+        }
+        if(nfound == 2 && (!dup || found[1] + pat->pattern_size < dup + fm->patterns[dup_p].pattern_size)) {
+            dup = found[1];
+            dup_p = p;
+        }
     }
-    
-    free(fm2.index_paths); // could be done earlier
-    free(fm2.nodes);
-    free(fm2.nodes2);
-    
+    // free these before dying, for try_findmany_go
+    free(nhits);
+    free(hits);
+    if(dup) {
+        struct pattern *pat = &fm->patterns[dup_p];
+        die("found [%s] multiple times in range: first at %08llx then at %08llx", pat->name, (uint64_t) (*pat->result - pat->offset), (uint64_t) (dup - fs.start + fm->range.start));
+    }
+
     for(int p = 0; p < fm->num_patterns; p++) {
         struct pattern *pat = &fm->patterns[p];
-        if(!*pat->result) {
+        if(!pat->found) {
             die("didn't find [%s] in range(%llx, %zx)", pat->name, (uint64_t) fm->range.start, fm->range.size);
         }
     }
 
-    free(fm->patterns);
-    free(fm);
+    findmany_free(fm);
+}
+
+bool try_findmany_go(struct findmany *fm, struct data_status *status) {
+    if(DATA_TRY(status, findmany_go(fm))) {
+        return true;
+    }
+    findmany_free(fm);
+    return false;
+}
+
+bool try_find_data(range_t range, const char *to_find, int align, int options, addr_t *result, struct data_status *status) {
+    *result = 0;
+    return DATA_TRY(status, *result = find_data(range, to_find, align, options));
+}
+
+bool try_find_string(range_t range, const char *string, int align, int options, addr_t *result, struct data_status *status) {
+    *result = 0;
+    return DATA_TRY(status, *result = find_string(range, string, align, options));
+}
+
+bool try_find_bytes(range_t range, const char *bytes, size_t len, int align, int options, addr_t *result, struct data_status *status) {
+    *result = 0;
+    return DATA_TRY(status, *result = find_bytes(range, bytes, len, align, options));
+}
+
+bool try_find_int32(range_t range, uint32_t number, int options, addr_t *result, struct data_status *status) {
+    *result = 0;
+    return DATA_TRY(status, *result = find_int32(range, number, options));
 }
@@ -11,6 +11,9 @@ addr_t find_data(range_t range, const char *to_find, int align, int options);
 addr_t find_string(range_t range, const char *string, int align, int options);
 addr_t find_bytes(range_t range, const char *bytes, size_t len, int align, int options);
 addr_t find_int32(range_t range, uint32_t number, int options);
+// the first occurrence of each number, in one pass; results[i] is 0 if numbers[i] wasn't found
+void find_int32s(range_t range, const uint32_t *numbers, size_t count, addr_t *results, int options);
+void find_int64s(range_t range, const uint64_t *numbers, size_t count, addr_t *results, int options);
 
 // helper functions
 addr_t find_bof(range_t range, addr_t eof, int is_thumb);
@@ -28,4 +31,12 @@ struct findmany *findmany_init(range_t range);
 void findmany_add(addr_t *result, struct findmany *fm, const char *to_find);
 void findmany_go(struct findmany *fm);
 
+// these return false instead of dying; *result is 0 then
+bool try_find_data(range_t range, const char *to_find, int align, int options, addr_t *result, struct data_status *status);
+bool try_find_string(range_t range, const char *string, int align, int options, addr_t *result, struct data_status *status);
+bool try_find_bytes(range_t range, const char *bytes, size_t len, int align, int options, addr_t *result, struct data_status *status);
+bool try_find_int32(range_t range, uint32_t number, int options, addr_t *result, struct data_status *status);
+// fm is freed either way
+bool try_findmany_go(struct findmany *fm, struct data_status *status);
+
 __END_DECLS
@@ -3,6 +3,7 @@
 #include "headers/nlist.h"
 #include "headers/fat.h"
 #include "read_dyld_info.h"
+#include <stddef.h>
 
 const int desired_cputype = CPU_TYPE_ARM;
 const int desired_cpusubtype = CPU_SUBTYPE_ARM_V7;
@@ -60,7 +61,7 @@ static void do_load_commands(struct binary *binary) {
         die("segment overflow");
     }
     binary->nsegments = nsegs;
-    struct data_segment *seg = binary->segments = malloc(sizeof(*binary->segments) * binary->nsegments);
+    struct data_segment *seg = binary->segments = b_alloc(binary, sizeof(*binary->segments) * binary->nsegments);
     CMD_ITERATE(hdr, cmd) {
         switch(cmd->cmd) {
         MACHO_SPECIALIZE(
@@ -78,10 +79,11 @@ static void do_load_commands(struct binary *binary) {
         )
         }
     }
+    b_index_segments(binary);
 }
 
 static void do_symbols(struct binary *binary) {
-    binary->mach = calloc(sizeof(*binary->mach), 1);
+    binary->mach = b_alloc(binary, sizeof(*binary->mach));
     binary->mach->hdr = b_mach_hdr(binary);
 
     CMD_ITERATE(b_mach_hdr(binary), cmd) {
@@ -241,20 +243,88 @@ void *b_macho_nth_symbol(const struct binary *binary, uint32_t n) {
 }
 
 
-static addr_t sym_nlist(const struct binary *binary, const char *name, int options) {
-    // I stole dyld's codez
-    const struct nlist *base = binary->mach->ext_symtab;
-    for(uint32_t n = binary->mach->ext_nsyms; n > 0; n /= 2) {
-        const struct nlist *pivot = base + n/2;
-        struct data_sym ds = convert_nlist(binary, pivot, options);
-        int cmp = strcmp(name, ds.name);
-        if(cmp == 0) {
-            return ds.address;
-        } else if(cmp > 0) {
-            base = pivot + 1; 
-            n--;
+#define SYM_INDEX_EMPTY 0xffffffff
+
+static uint32_t sym_hash(const char *name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while(*name) {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct macho_sym_index *sym_index_new(const struct binary *binary, uint64_t count, const char *strings, uint32_t strings_size) {
+    if(count > 0x40000000) {
+        die("too many symbols to index (%llu)", (long long) count);
+    }
+    uint32_t size = 8;
+    while(size < count * 2) size *= 2;
+    struct macho_sym_index *index = b_alloc(binary, sizeof(*index));
+    index->entries = b_alloc(binary, size * sizeof(*index->entries));
+    for(uint32_t i = 0; i < size; i++) {
+        index->entries[i].name = SYM_INDEX_EMPTY;
+    }
+    index->mask = size - 1;
+    index->strings = strings;
+    index->strings_size = strings_size;
+    return index;
+}
+
+// if a name is already there, the first one wins
+static void sym_index_insert(struct macho_sym_index *index, uint32_t name, uint64_t value) {
+    uint32_t hash = sym_hash(index->strings + name);
+    for(uint32_t i = hash; ; i++) {
+        struct macho_sym_entry *e = &index->entries[i & index->mask];
+        if(e->name == SYM_INDEX_EMPTY) {
+            *e = (struct macho_sym_entry) {hash, name, value};
+            index->count++;
+            return;
+        }
+        if(e->hash == hash && !strcmp(index->strings + e->name, index->strings + name)) {
+            return;
         }
     }
+}
+
+static const struct macho_sym_entry *sym_index_find(const struct macho_sym_index *index, const char *name) {
+    uint32_t hash = sym_hash(name);
+    for(uint32_t i = hash; ; i++) {
+        const struct macho_sym_entry *e = &index->entries[i & index->mask];
+        if(e->name == SYM_INDEX_EMPTY) {
+            return NULL;
+        }
+        if(e->hash == hash && !strcmp(index->strings + e->name, name)) {
+            return e;
+        }
+    }
+}
+
+// values are indices into the whole symtab, so the thumb bit can be applied at lookup time
+static struct macho_sym_index *sym_index_nlist(const struct binary *binary, const void *nl, uint32_t n) {
+    size_t size;
+    MACHO_SPECIALIZE_POINTER_SIZE(binary, size = sizeof(nlist_x);)
+    uint32_t first = ((const char *) nl - (const char *) binary->mach->symtab) / size;
+    struct macho_sym_index *index = sym_index_new(binary, n, binary->mach->strtab, binary->mach->strsize);
+    for(uint32_t i = 0; i < n; i++, nl += size) {
+        struct data_sym ds = convert_nlist(binary, nl, 0);
+        sym_index_insert(index, ds.name - binary->mach->strtab, first + i);
+    }
+    return index;
+}
+
+static const struct macho_sym_index *ext_index(const struct binary *binary) {
+    struct mach_binary *mach = binary->mach;
+    const struct macho_sym_index *index = b_lazy_get(mach->ext_index);
+    return index ? index : b_lazy_set(mach->ext_index, sym_index_nlist(binary, mach->ext_symtab, mach->ext_nsyms));
+}
+
+static addr_t sym_nlist(const struct binary *binary, const char *name, int options) {
+    const struct macho_sym_entry *e = sym_index_find(ext_index(binary), name);
+    if(e) {
+        return convert_nlist(binary, b_macho_nth_symbol(binary, e->value), options).address;
+    }
 
     for(unsigned int i = 0; i < binary->nreexports; i++) {
         addr_t result;
@@ -266,85 +336,140 @@ static addr_t sym_nlist(const struct binary *binary, const char *name, int optio
     return 0;
 }
 
-static addr_t trie_recurse(const struct binary *binary, void *ptr, char *start, char *end, const char *name0, const char *name, int options) {
-    if(start == end) return 0;
+struct trie_walk {
+    char *start, *end;
+    size_t visits;
+    char *name;
+    size_t name_cap;
+    char *names;
+    uint32_t names_size;
+    size_t names_cap;
+    struct macho_sym_entry *ents;
+    uint32_t nents, cap_ents;
+};
+
+static void trie_walk(struct trie_walk *w, char *node, size_t len, unsigned int depth) {
+    // every node of a real trie is at least two bytes, so this catches loops
+    if(++w->visits > (size_t) (w->end - w->start) || depth > 1024) {
+        die("export trie is malformed");
+    }
+    void *ptr = node, *end = w->end;
     uint8_t terminal_size = read_int(&ptr, end, uint8_t);
     if(terminal_size) {
-        uint32_t flags = read_uleb128(&ptr, end);
-        uint32_t address = read_uleb128(&ptr, end);
-        uint32_t resolver = 0;
-        if(flags & 0x10) {
-            resolver = read_uleb128(&ptr, end);
-        }
-        if(!name[0]) {
-            if(resolver) {
-                fprintf(stderr, "trie_recurse: %s has a resolver; returning failure\n", name0);
-                return 0;
-            }
-            if(flags & 8) {
-                // indirect definition
-                address--;
-                if(address >= binary->nreexports) {
-                    die("invalid sub-library %d", address);
-                }
-                return b_sym(&binary->reexports[address], name0, options);
+        void *term = read_bytes(&ptr, end, terminal_size);
+        uint32_t flags = read_uleb128(&term, ptr);
+        uint32_t address = read_uleb128(&term, ptr);
+        if((flags & 0x10) && !read_uleb128(&term, ptr)) {
+            // no actual resolver
+            flags &= ~0x10;
+        }
+        if(len >= UINT32_MAX - w->names_size) {
+            die("export trie is malformed");
+        }
+        if(w->names_size + len + 1 > w->names_cap) {
+            w->names_cap = w->names_cap * 2 > w->names_size + len + 1 ? w->names_cap * 2 : w->names_size + len + 1;
+            if(!(w->names = realloc(w->names, w->names_cap))) {
+                die("out of memory");
             }
-            if(binary->cputype == CPU_TYPE_ARM && !(options & TO_EXECUTE)) {
-                address &= ~1u;
+        }
+        memcpy(w->names + w->names_size, w->name, len);
+        w->names[w->names_size + len] = 0;
+        if(w->nents == w->cap_ents) {
+            w->cap_ents = w->cap_ents ? w->cap_ents * 2 : 64;
+            if(!(w->ents = realloc(w->ents, w->cap_ents * sizeof(*w->ents)))) {
+                die("out of memory");
             }
-            return ((addr_t) address) + binary->mach->export_baseaddr;
         }
+        w->ents[w->nents++] = (struct macho_sym_entry) {0, w->names_size, (uint64_t) flags << 32 | address};
+        w->names_size += len + 1;
     }
 
     uint8_t child_count = read_int(&ptr, end, uint8_t);
     while(child_count--) {
-        const char *name2 = name;
-        char c;
-        while(1) {
-            c = read_int(&ptr, end, char);
-            if(!c) {
-                uint64_t offset = read_uleb128(&ptr, end);
-                if(offset >= (size_t) (end - start)) die("invalid child offset");
-                return trie_recurse(binary, start + offset, start, end, name0, name2, options);
-            }
-            if(c != *name2++) {
-                break;
+        const char *label = read_cstring(&ptr, end);
+        uint64_t offset = read_uleb128(&ptr, end);
+        if(offset >= (size_t) (w->end - w->start)) die("invalid child offset");
+        size_t label_len = strlen(label);
+        if(len + label_len >= w->name_cap) {
+            w->name_cap = (len + label_len) * 2;
+            if(!(w->name = realloc(w->name, w->name_cap))) {
+                die("out of memory");
             }
         }
-        // skip the rest
-        read_cstring(&ptr, end);
-        read_uleb128(&ptr, end);
+        memcpy(w->name + len, label, label_len);
+        trie_walk(w, w->start + offset, len + label_len, depth + 1);
     }
-    return 0;
+}
+
+static struct macho_sym_index *sym_index_trie(const struct binary *binary) {
+    struct mach_binary *mach = binary->mach;
+    struct trie_walk w = {
+        .start = mach->export_trie.start,
+        .end = (char *) mach->export_trie.start + mach->export_trie.size,
+    };
+    if(w.start != w.end) {
+        trie_walk(&w, w.start, 0, 0);
+    }
+    char *names = b_alloc(binary, w.names_size);
+    memcpy(names, w.names, w.names_size);
+    struct macho_sym_index *index = sym_index_new(binary, w.nents, names, w.names_size);
+    for(uint32_t i = 0; i < w.nents; i++) {
+        sym_index_insert(index, w.ents[i].name, w.ents[i].value);
+    }
+    free(w.ents);
+    free(w.name);
+    free(w.names);
+    return index;
+}
+
+static const struct macho_sym_index *trie_index(const struct binary *binary) {
+    struct mach_binary *mach = binary->mach;
+    const struct macho_sym_index *index = b_lazy_get(mach->trie_index);
+    return index ? index : b_lazy_set(mach->trie_index, sym_index_trie(binary));
 }
 
 static addr_t sym_trie(const struct binary *binary, const char *name, int options) {
-    return trie_recurse(binary,
-                        binary->mach->export_trie.start,
-                        binary->mach->export_trie.start,
-                        (char *)binary->mach->export_trie.start + binary->mach->export_trie.size,
-                        name,
-                        name,
-                        options);
+    const struct macho_sym_entry *e = sym_index_find(trie_index(binary), name);
+    if(!e) return 0;
+    uint32_t flags = e->value >> 32;
+    uint32_t address = (uint32_t) e->value;
+    if(flags & 0x10) {
+        fprintf(stderr, "sym_trie: %s has a resolver; returning failure\n", name);
+        return 0;
+    }
+    if(flags & 8) {
+        // indirect definition
+        address--;
+        if(address >= binary->nreexports) {
+            die("invalid sub-library %d", address);
+        }
+        return b_sym(&binary->reexports[address], name, options);
+    }
+    if(binary->cputype == CPU_TYPE_ARM && !(options & TO_EXECUTE)) {
+        address &= ~1u;
+    }
+    return ((addr_t) address) + binary->mach->export_baseaddr;
+}
+
+static const struct macho_sym_index *private_index(const struct binary *binary) {
+    struct mach_binary *mach = binary->mach;
+    const struct macho_sym_index *index = b_lazy_get(mach->private_index);
+    return index ? index : b_lazy_set(mach->private_index, sym_index_nlist(binary, mach->symtab, mach->nsyms));
 }
 
 static addr_t sym_private(const struct binary *binary, const char *name, int options) {
     if(!binary->mach->symtab) {
         die("we wanted %s but there is no symbol table", name);
     }
-    MACHO_SPECIALIZE_POINTER_SIZE(binary,
-        const nlist_x *base = binary->mach->symtab;
-        for(uint32_t i = 0; i < binary->mach->nsyms; i++) {
-            struct data_sym ds = convert_nlist(binary, base + i, options);
-            if(!strcmp(ds.name, name)) return ds.address;
-        }
-    )
-    return 0;
+    const struct macho_sym_entry *e = sym_index_find(private_index(binary), name);
+    return e ? convert_nlist(binary, b_macho_nth_symbol(binary, e->value), options).address : 0;
 }
 
-
-static addr_t sym_imported(const struct binary *binary, const char *name, __unused int options) {
+// if index is NULL, just count the pointers
+static uint64_t imported_walk(const struct binary *binary, struct macho_sym_index *index) {
     // most of this function is copied and pasted from link.c :$
+    uint64_t count = 0;
+    if(!binary->mach->dysymtab) return 0;
     CMD_ITERATE(b_mach_hdr(binary), cmd) {
         MACHO_SPECIALIZE(
             if(cmd->cmd == LC_SEGMENT_X) {
@@ -353,6 +478,8 @@ static addr_t sym_imported(const struct binary *binary, const char *name, __unus
                 for(uint32_t i = 0; i < seg->nsects; i++, sect++) {
                     uint8_t type = sect->flags & SECTION_TYPE;
                     if(type != S_NON_LAZY_SYMBOL_POINTERS && type != S_LAZY_SYMBOL_POINTERS) continue;
+                    count += sect->size / 4;
+                    if(!index) continue;
 
                     uint32_t indirect_table_offset = sect->reserved1;
                     uint32_t *indirect = rangeconv_off((range_t) {binary, (addr_t) (binary->mach->dysymtab->indirectsymoff + indirect_table_offset*sizeof(uint32_t)), (sect->size / 4) * sizeof(uint32_t)}, MUST_FIND).start;
@@ -361,15 +488,27 @@ static addr_t sym_imported(const struct binary *binary, const char *name, __unus
                         uint32_t sym = indirect[i];
                         if(sym == INDIRECT_SYMBOL_LOCAL || sym == INDIRECT_SYMBOL_ABS) continue;
                         nlist_x *nl = b_macho_nth_symbol(binary, sym);
-                        if(!strcmp(binary->mach->strtab + nl->n_un.n_strx, name)) {
-                            return sect->addr + 4*i;
-                        }
+                        sym_index_insert(index, nl->n_un.n_strx, sect->addr + 4*i);
                     }
                 }
             }
         )
     }
-    return 0;
+    return count;
+}
+
+static const struct macho_sym_index *imported_index(const struct binary *binary) {
+    struct mach_binary *mach = binary->mach;
+    const struct macho_sym_index *index = b_lazy_get(mach->imported_index);
+    if(index) return index;
+    struct macho_sym_index *built = sym_index_new(binary, imported_walk(binary, NULL), mach->strtab, mach->strsize);
+    imported_walk(binary, built);
+    return b_lazy_set(mach->imported_index, built);
+}
+
+static addr_t sym_imported(const struct binary *binary, const char *name, __unused int options) {
+    const struct macho_sym_entry *e = sym_index_find(imported_index(binary), name);
+    return e ? e->value : 0;
 }
 
 static addr_t sym(const struct binary *binary, const char *name, int options) {
@@ -425,27 +564,105 @@ range_t b_macho_segrange(const struct binary *binary, const char *segname) {
     die("no such segment %s", segname);
 }
 
-range_t b_macho_sectrange(const struct binary *binary, const char *segname, const char *sectname) {
+void b_macho_advise_segments(const struct binary *binary) {
     CMD_ITERATE(b_mach_hdr(binary), cmd) {
         MACHO_SPECIALIZE(
             if(cmd->cmd == LC_SEGMENT_X) {
                 segment_command_x *seg = (void *) cmd;
-                if(!strncmp(seg->segname, segname, 16)) {
-                    section_x *sect = (void *) (seg + 1);
-                    for(uint32_t i = 0; i < seg->nsects; i++) {
-                        if(!strncmp(sect[i].sectname, sectname, 16)) {
-                            return (range_t) {binary, sect->addr, sect->size};
-                        }
-                    }
+                // symbol and relocation tables get walked front to back; code gets poked at here and there
+                enum prange_advice advice;
+                if(!strncmp(seg->segname, "__LINKEDIT", 16)) {
+                    advice = ADVISE_SEQUENTIAL;
+                } else if(!strncmp(seg->segname, "__TEXT", 16)) {
+                    advice = ADVISE_RANDOM;
+                } else {
+                    continue;
                 }
+                prange_advise(rangeconv_off((range_t) {binary, seg->fileoff, seg->filesize}, 0), advice);
             }
         )
     }
+}
+
+static int section_entry_cmp(const void *a, const void *b) {
+    const struct macho_section_entry *x = a, *y = b;
+    int cmp;
+    if((cmp = strncmp(x->segname, y->segname, 16))) return cmp;
+    if((cmp = strncmp(x->sectname, y->sectname, 16))) return cmp;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static struct macho_section_table *build_sections(const struct binary *binary) {
+    uint32_t n = 0;
+    CMD_ITERATE(b_mach_hdr(binary), cmd) {
+        MACHO_SPECIALIZE(
+            if(cmd->cmd == LC_SEGMENT_X) {
+                n += ((segment_command_x *) cmd)->nsects;
+            }
+        )
+    }
+    // +1 so it's never NULL
+    struct macho_section_entry *out = b_alloc(binary, (n + 1) * sizeof(*out));
+    n = 0;
+    CMD_ITERATE(b_mach_hdr(binary), cmd) {
+        MACHO_SPECIALIZE(
+            if(cmd->cmd == LC_SEGMENT_X) {
+                segment_command_x *seg = (void *) cmd;
+                section_x *sect = (void *) (seg + 1);
+                for(uint32_t i = 0; i < seg->nsects; i++, n++) {
+                    memcpy(out[n].segname, seg->segname, 16);
+                    memcpy(out[n].sectname, sect[i].sectname, 16);
+                    out[n].addr = sect[i].addr;
+                    out[n].size = sect[i].size;
+                    out[n].order = n;
+                }
+            }
+        )
+    }
+    qsort(out, n, sizeof(*out), section_entry_cmp);
+    struct macho_section_table *table = b_alloc(binary, sizeof(*table));
+    table->entries = out;
+    table->count = n;
+    return table;
+}
+
+static const struct macho_section_table *section_table(const struct binary *binary) {
+    const struct macho_section_table *table = b_lazy_get(binary->mach->sections);
+    return table ? table : b_lazy_set(binary->mach->sections, build_sections(binary));
+}
+
+range_t b_macho_sectrange(const struct binary *binary, const char *segname, const char *sectname) {
+    const struct macho_section_table *table = section_table(binary);
+    const struct macho_section_entry *sections = table->entries;
+    uint32_t lo = 0, hi = table->count;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(sections[mid].segname, segname, 16);
+        if(!cmp) cmp = strncmp(sections[mid].sectname, sectname, 16);
+        if(cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if(lo < table->count && !strncmp(sections[lo].segname, segname, 16) && !strncmp(sections[lo].sectname, sectname, 16)) {
+        return (range_t) {binary, sections[lo].addr, sections[lo].size};
+    }
     die("no such segment %s", segname);
 }
 
 void b_load_macho(struct binary *binary, const char *filename) {
-    return b_prange_load_macho(binary, load_file(filename, true, NULL), 0, filename);
+    prange_t pr = load_file(filename, true, NULL);
+    b_own_mapping(binary, pr);
+    b_prange_load_macho(binary, pr, 0, filename);
+}
+
+bool b_try_load_macho(struct binary *binary, const char *filename, struct data_status *status) {
+    if(DATA_TRY(status, b_load_macho(binary, filename))) {
+        return true;
+    }
+    b_destroy(binary);
+    return false;
 }
 
 addr_t b_macho_reloc_base(const struct binary *binary) {
@@ -472,3 +689,296 @@ const char *convert_lc_str(const struct load_command *cmd, uint32_t offset) {
     return ret;
 }
 
+
+// sidecar index files
+
+#define INDEX_MAGIC "dataidx"
+#define INDEX_VERSION 3
+
+enum {
+    INDEX_EXT,
+    INDEX_PRIVATE,
+    INDEX_IMPORTED,
+    INDEX_TRIE,
+    INDEX_TRIE_NAMES,
+    INDEX_ADDR_SYMS,
+    INDEX_SECTIONS,
+    INDEX_NTABLES
+};
+
+struct index_table {
+    uint64_t offset, count;
+};
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pointer_size;
+    uint8_t key[16];
+    uint64_t base;
+    uint64_t size;
+    uint32_t nsyms, strsize;
+    uint64_t addr_sym_names; // relative to valid_range.start
+    struct index_table tables[INDEX_NTABLES];
+};
+
+static const size_t index_entry_size[INDEX_NTABLES] = {
+    [INDEX_EXT] = sizeof(struct macho_sym_entry),
+    [INDEX_PRIVATE] = sizeof(struct macho_sym_entry),
+    [INDEX_IMPORTED] = sizeof(struct macho_sym_entry),
+    [INDEX_TRIE] = sizeof(struct macho_sym_entry),
+    [INDEX_TRIE_NAMES] = 1,
+    [INDEX_ADDR_SYMS] = sizeof(struct data_addr_sym),
+    [INDEX_SECTIONS] = sizeof(struct macho_section_entry),
+};
+
+// LC_UUID if there is one, otherwise a hash of the file and its size
+static void index_key(const struct binary *binary, uint8_t key[16]) {
+    CMD_ITERATE(b_mach_hdr(binary), cmd) {
+        if(cmd->cmd == LC_UUID && cmd->cmdsize >= sizeof(struct uuid_command)) {
+            memcpy(key, ((struct uuid_command *) cmd)->uuid, 16);
+            return;
+        }
+    }
+    const uint8_t *p = binary->valid_range.start;
+    size_t size = binary->valid_range.size;
+    uint64_t hash = 0xcbf29ce484222325ull, word;
+    for(; size >= 8; p += 8, size -= 8) {
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    while(size--) {
+        hash = (hash ^ *p++) * 0x100000001b3ull;
+    }
+    uint64_t total = binary->valid_range.size;
+    memcpy(key, &hash, 8);
+    memcpy(key + 8, &total, 8);
+}
+
+// the tables hold addresses, so a copy that has been slid needs its own index
+static uint64_t index_base(const struct binary *binary) {
+    CMD_ITERATE(b_mach_hdr(binary), cmd) {
+        MACHO_SPECIALIZE(
+            if(cmd->cmd == LC_SEGMENT_X) {
+                return ((segment_command_x *) cmd)->vmaddr;
+            }
+        )
+    }
+    return 0;
+}
+
+static void index_header_init(const struct binary *binary, struct index_header *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, INDEX_MAGIC, 8);
+    hdr->version = INDEX_VERSION;
+    hdr->pointer_size = b_pointer_size(binary);
+    index_key(binary, hdr->key);
+    hdr->base = index_base(binary);
+    hdr->size = binary->valid_range.size;
+    hdr->nsyms = binary->mach->nsyms;
+    hdr->strsize = binary->mach->strsize;
+}
+
+static bool index_check_syms(const struct macho_sym_entry *entries, uint64_t count, uint32_t name_limit, uint64_t value_limit, uint32_t *used) {
+    if(!count) return true;
+    if(count < 8 || count > 0x80000000u || (count & (count - 1))) return false;
+    *used = 0;
+    for(uint64_t i = 0; i < count; i++) {
+        if(entries[i].name == SYM_INDEX_EMPTY) continue;
+        if(entries[i].name >= name_limit || entries[i].value >= value_limit) return false;
+        ++*used;
+    }
+    // lookups stop at an empty slot
+    return *used < count;
+}
+
+bool b_macho_load_index(struct binary *binary, const char *path) {
+#define _arg path
+    if(!binary->mach) {
+        die("not a Mach-O");
+    }
+    struct mach_binary *mach = binary->mach;
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) return false;
+    off_t end = lseek(fd, 0, SEEK_END);
+    if(end < (off_t) sizeof(struct index_header) || (sizeof(off_t) > sizeof(size_t) && end > (off_t) SIZE_MAX)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, (size_t) end, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return false;
+    size_t size = (size_t) end;
+
+    const struct index_header *hdr = map;
+    struct index_header expected;
+    index_header_init(binary, &expected);
+    if(memcmp(hdr, &expected, offsetof(struct index_header, addr_sym_names))) {
+        goto bad;
+    }
+
+    void *tables[INDEX_NTABLES];
+    for(int t = 0; t < INDEX_NTABLES; t++) {
+        const struct index_table *table = &hdr->tables[t];
+        if((table->offset & 7) || table->offset > size || table->count > (size - table->offset) / index_entry_size[t]) {
+            goto bad;
+        }
+        tables[t] = table->count ? (char *) map + table->offset : NULL;
+    }
+
+    const struct index_table *ht = hdr->tables;
+    uint32_t used[INDEX_TRIE + 1] = {0};
+    uint64_t trie_names_size = ht[INDEX_TRIE_NAMES].count;
+    if(trie_names_size && ((char *) tables[INDEX_TRIE_NAMES])[trie_names_size - 1]) goto bad;
+    if(trie_names_size > UINT32_MAX) goto bad;
+    if(!index_check_syms(tables[INDEX_EXT], ht[INDEX_EXT].count, mach->strsize, mach->nsyms, &used[INDEX_EXT]) ||
+       !index_check_syms(tables[INDEX_PRIVATE], ht[INDEX_PRIVATE].count, mach->strsize, mach->nsyms, &used[INDEX_PRIVATE]) ||
+       !index_check_syms(tables[INDEX_IMPORTED], ht[INDEX_IMPORTED].count, mach->strsize, UINT64_MAX, &used[INDEX_IMPORTED]) ||
+       !index_check_syms(tables[INDEX_TRIE], ht[INDEX_TRIE].count, trie_names_size, UINT64_MAX, &used[INDEX_TRIE])) {
+        goto bad;
+    }
+
+    // address table names have to land in the string table
+    const char *names = (char *) binary->valid_range.start + hdr->addr_sym_names;
+    const struct data_addr_sym *addr_syms = tables[INDEX_ADDR_SYMS];
+    if(ht[INDEX_ADDR_SYMS].count &&
+       (hdr->addr_sym_names >= binary->valid_range.size || !mach->strtab ||
+        names < mach->strtab || names >= mach->strtab + mach->strsize)) {
+        goto bad;
+    }
+    for(uint64_t i = 0; i < ht[INDEX_ADDR_SYMS].count; i++) {
+        if(addr_syms[i].name >= mach->strsize - (size_t) (names - mach->strtab) ||
+           addr_syms[i].address >= addr_syms[i].end ||
+           (i && addr_syms[i].address <= addr_syms[i - 1].address)) {
+            goto bad;
+        }
+    }
+
+    const struct macho_sym_index **indices[] = {&mach->ext_index, &mach->private_index, &mach->imported_index, &mach->trie_index};
+    for(int t = INDEX_EXT; t <= INDEX_TRIE; t++) {
+        if(tables[t] && !b_lazy_get(*indices[t])) {
+            struct macho_sym_index *index = b_alloc(binary, sizeof(*index));
+            index->entries = tables[t];
+            index->mask = ht[t].count - 1;
+            index->count = used[t];
+            if(t == INDEX_TRIE) {
+                index->strings = tables[INDEX_TRIE_NAMES];
+                index->strings_size = trie_names_size;
+            } else {
+                index->strings = mach->strtab;
+                index->strings_size = mach->strsize;
+            }
+            b_lazy_set(*indices[t], index);
+        }
+    }
+    if(tables[INDEX_ADDR_SYMS] && !b_lazy_get(binary->addr_syms)) {
+        struct data_addr_sym_table *table = b_alloc(binary, sizeof(*table));
+        table->syms = tables[INDEX_ADDR_SYMS];
+        table->nsyms = ht[INDEX_ADDR_SYMS].count;
+        table->names = names;
+        b_lazy_set(binary->addr_syms, table);
+    }
+    if(tables[INDEX_SECTIONS] && !b_lazy_get(mach->sections)) {
+        struct macho_section_table *table = b_alloc(binary, sizeof(*table));
+        table->entries = tables[INDEX_SECTIONS];
+        table->count = ht[INDEX_SECTIONS].count;
+        b_lazy_set(mach->sections, table);
+    }
+    mach->index_file = (prange_t) {map, size};
+    b_own_mapping(binary, mach->index_file);
+    return true;
+
+bad:
+    fprintf(stderr, "b_macho_load_index: %s is stale or corrupt\n", path);
+    munmap(map, size);
+    return false;
+#undef _arg
+}
+
+void b_macho_store_index(struct binary *binary, const char *path) {
+#define _arg path
+    if(!binary->mach) {
+        die("not a Mach-O");
+    }
+    struct mach_binary *mach = binary->mach;
+
+    // build everything
+    const struct macho_sym_index *indices[] = {
+        ext_index(binary),
+        mach->symtab ? private_index(binary) : NULL,
+        mach->symtab ? imported_index(binary) : NULL,
+        mach->export_trie.start ? trie_index(binary) : NULL,
+    };
+    const struct macho_section_table *sections = section_table(binary);
+    b_addr_to_sym(binary, 0, NULL);
+    const struct data_addr_sym_table *addr_syms = b_lazy_get(binary->addr_syms);
+
+    struct index_header hdr;
+    index_header_init(binary, &hdr);
+    if(addr_syms->nsyms) {
+        if(addr_syms->names < (char *) binary->valid_range.start || addr_syms->names >= (char *) binary->valid_range.start + binary->valid_range.size) {
+            die("symbol names are outside the binary");
+        }
+        hdr.addr_sym_names = addr_syms->names - (char *) binary->valid_range.start;
+    }
+
+    const void *tables[INDEX_NTABLES] = {NULL};
+    for(int t = INDEX_EXT; t <= INDEX_TRIE; t++) {
+        if(indices[t]) {
+            tables[t] = indices[t]->entries;
+            hdr.tables[t].count = (uint64_t) indices[t]->mask + 1;
+        }
+    }
+    if(indices[INDEX_TRIE]) {
+        tables[INDEX_TRIE_NAMES] = indices[INDEX_TRIE]->strings;
+        hdr.tables[INDEX_TRIE_NAMES].count = indices[INDEX_TRIE]->strings_size;
+    }
+    tables[INDEX_ADDR_SYMS] = addr_syms->syms;
+    hdr.tables[INDEX_ADDR_SYMS].count = addr_syms->nsyms;
+    tables[INDEX_SECTIONS] = sections->entries;
+    hdr.tables[INDEX_SECTIONS].count = sections->count;
+
+    size_t size = sizeof(hdr);
+    for(int t = 0; t < INDEX_NTABLES; t++) {
+        size = (size + 7) & ~7;
+        hdr.tables[t].offset = size;
+        size += hdr.tables[t].count * index_entry_size[t];
+    }
+    autofree char *buf = calloc(1, size);
+    memcpy(buf, &hdr, sizeof(hdr));
+    for(int t = 0; t < INDEX_NTABLES; t++) {
+        if(hdr.tables[t].count) {
+            memcpy(buf + hdr.tables[t].offset, tables[t], hdr.tables[t].count * index_entry_size[t]);
+        }
+    }
+
+    // write it next to the destination and rename, so nobody maps a half-written index
+    autofree char *tmp = malloc(strlen(path) + 32);
+    sprintf(tmp, "%s.%d.tmp", path, (int) getpid());
+    store_file((prange_t) {buf, size}, tmp, 0644);
+    if(rename(tmp, path)) {
+        unlink(tmp);
+        edie("could not rename");
+    }
+#undef _arg
+}
+
+void b_macho_use_index(struct binary *binary, const char *dir) {
+#define _arg dir
+    if(!binary->mach) {
+        die("not a Mach-O");
+    }
+    uint8_t key[16];
+    index_key(binary, key);
+    char name[33];
+    for(int i = 0; i < 16; i++) {
+        sprintf(name + 2*i, "%02x", key[i]);
+    }
+    autofree char *path = malloc(strlen(dir) + sizeof(name) + 32);
+    sprintf(path, "%s/%s-%llx.dataidx", dir, name, (long long) index_base(binary));
+    if(!b_macho_load_index(binary, path)) {
+        b_macho_store_index(binary, path);
+    }
+#undef _arg
+}
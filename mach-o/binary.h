@@ -31,6 +31,33 @@
 #define MACHO_SPECIALIZE_POINTER_SIZE(binary, text...) _MACHO_SPECIALIZE_32(text)
 #endif
 
+struct macho_sym_entry {
+    uint32_t hash;
+    uint32_t name; // offset into the index's strings
+    uint64_t value; // symtab index, address, or (flags << 32 | address) for the trie
+};
+
+// open addressing
+struct macho_sym_index {
+    struct macho_sym_entry *entries;
+    uint32_t mask;
+    uint32_t count;
+    const char *strings; // the strtab, or the trie's own names
+    uint32_t strings_size;
+};
+
+// sorted by segment name, section name, then load command order
+struct macho_section_entry {
+    char segname[16], sectname[16];
+    uint64_t addr, size;
+    uint32_t order, reserved;
+};
+
+struct macho_section_table {
+    struct macho_section_entry *entries;
+    uint32_t count;
+};
+
 struct mach_binary {
     // this is unnecessary, don't use it
     struct mach_header *hdr;
@@ -51,6 +78,15 @@ struct mach_binary {
     char *strtab;
     uint32_t strsize;
     const struct dysymtab_command *dysymtab;
+
+    // for b_sym, built lazily (see b_lazy_get)
+    const struct macho_sym_index *ext_index, *private_index, *imported_index, *trie_index;
+
+    // for b_macho_sectrange, built lazily
+    const struct macho_section_table *sections;
+
+    // mapped by b_macho_load_index
+    prange_t index_file;
 };
 
 __BEGIN_DECLS
@@ -61,16 +97,35 @@ static inline struct mach_header *b_mach_hdr(const struct binary *binary) {
 
 __attribute__((pure)) range_t b_macho_segrange(const struct binary *binary, const char *segname);
 __attribute__((pure)) range_t b_macho_sectrange(const struct binary *binary, const char *segname, const char *sectname);
+// madvise __LINKEDIT sequential and __TEXT random
+void b_macho_advise_segments(const struct binary *binary);
 
 void b_prange_load_macho(struct binary *binary, prange_t range, size_t offset, const char *name);
 void b_prange_load_macho_nosyms(struct binary *binary, prange_t range, size_t offset, const char *name);
 
 void b_load_macho(struct binary *binary, const char *filename);
+// on failure, the binary is b_destroyed
+bool b_try_load_macho(struct binary *binary, const char *filename, struct data_status *status);
+
+// loads a lot of files, keeping up to depth of them (0 means 32) being opened and read ahead at once, with
+// io_uring where there is one.  callback gets each as it's ready (not necessarily in order) with its index in
+// filenames, and either the binary, which is b_destroyed when the callback returns, or NULL and why it failed
+typedef void (*b_bulk_callback_t)(void *ctx, size_t index, struct binary *binary, const struct data_status *status);
+void b_load_macho_bulk(const char *const *filenames, size_t count, unsigned int depth, b_bulk_callback_t callback, void *ctx);
 
 void *b_macho_nth_symbol(const struct binary *binary, uint32_t n);
 
 addr_t b_macho_reloc_base(const struct binary *binary);
 
+// sidecar index files hold the b_sym hash tables, the b_addr_to_sym table and the section table,
+// keyed by LC_UUID (or a hash of the file if there isn't one) and the first segment's address, since a
+// relocated copy has different addresses in them.  all three die on a binary that isn't a Mach-O
+// returns false and changes nothing if the file is missing or doesn't match this binary
+bool b_macho_load_index(struct binary *binary, const char *path);
+void b_macho_store_index(struct binary *binary, const char *path);
+// loads <dir>/<key>-<address>.dataidx, or builds everything and stores it there if that fails
+void b_macho_use_index(struct binary *binary, const char *dir);
+
 const char *convert_lc_str(const struct load_command *cmd, uint32_t offset);
 __END_DECLS
 
@@ -0,0 +1,451 @@
+#include "binary.h"
+#include "headers/loader.h"
+#include "headers/fat.h"
+#include "../find.h"
+#include <sys/stat.h>
+#include <stddef.h>
+// nested, since compilers without __has_include can't even parse it behind a false &&
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define BULK_URING 1
+#endif
+#endif
+
+// Bulk loading: instead of open, read the load commands, fault __LINKEDIT in, parse, one file at a time,
+// keep up to depth files somewhere in that pipeline so the disk always has something to do.  Each file
+// goes through:
+//   open -> read the first HEADER_READ bytes (and the rest of the load commands, if they don't fit)
+//        -> WILLNEED on __LINKEDIT (or the whole file, for fat files) -> load and hand to the callback
+// With io_uring all of those are in flight at once; without it, they're done synchronously but in the
+// same breadth-first order, so the readahead for a file is still started a few files before it's loaded.
+
+#define HEADER_READ 0x4000
+#define DEFAULT_DEPTH 32
+
+enum bulk_op {
+    BULK_OPEN,
+    BULK_HEADER,
+    BULK_ADVISE,
+};
+
+struct bulk_slot {
+    size_t index;
+    const char *filename;
+    enum bulk_op op;
+    int fd;
+    uint64_t file_size;
+    uint8_t *buf;
+    size_t buf_size, buf_valid;
+    uint64_t advise_offset, advise_size;
+};
+
+#ifdef BULK_URING
+struct uring {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int to_submit;
+};
+#endif
+
+struct bulk {
+    struct bulk_slot *slots;
+    unsigned int depth;
+#ifdef BULK_URING
+    bool use_ring;
+    struct uring ring;
+#endif
+    // synchronous completions, oldest first; each slot has at most one op outstanding, so depth is enough
+    unsigned int *done_slots;
+    int *done_results;
+    unsigned int done_head, done_count;
+};
+
+#ifdef BULK_URING
+static bool uring_init(struct uring *ring, unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) {
+        // old kernel, or seccomp says no
+        return false;
+    }
+
+    // make sure the ops we need are there before committing to the ring
+    size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    autofree struct io_uring_probe *probe = calloc(1, probe_size);
+    if(!probe || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0 ||
+       probe->last_op < IORING_OP_FADVISE ||
+       !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+       !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+       !(probe->ops[IORING_OP_FADVISE].flags & IO_URING_OP_SUPPORTED)) {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = ring->cq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if(ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        // the ring is only there to go faster, so do without it
+        if(ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        if(ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if(ring->sq_ring != MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        close(ring->fd);
+        return false;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (void *) (sq + params.sq_off.head);
+    ring->sq_tail = (void *) (sq + params.sq_off.tail);
+    ring->sq_mask = (void *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (void *) (sq + params.sq_off.array);
+    ring->cq_head = (void *) (cq + params.cq_off.head);
+    ring->cq_tail = (void *) (cq + params.cq_off.tail);
+    ring->cq_mask = (void *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (void *) (cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return true;
+}
+
+static void uring_destroy(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// there's always room: each slot has at most one op outstanding and the ring has at least depth entries
+static struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    unsigned int tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static void uring_enter(struct uring *ring, unsigned int min_complete) {
+    while(ring->to_submit || min_complete) {
+        int ret = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(ret < 0) {
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            edie("io_uring_enter failed");
+        }
+        ring->to_submit -= (unsigned int) ret;
+        if(min_complete) break;
+    }
+}
+
+static bool uring_reap(struct uring *ring, unsigned int *slot, int *result) {
+    unsigned int head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *slot = (unsigned int) cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+#endif
+
+// starts the slot's current op; its result turns up in bulk_wait
+static void bulk_submit(struct bulk *bulk, unsigned int s) {
+    struct bulk_slot *slot = &bulk->slots[s];
+    size_t read_size = slot->buf_size - slot->buf_valid;
+#ifdef BULK_URING
+    if(bulk->use_ring) {
+        struct io_uring_sqe *sqe = uring_sqe(&bulk->ring);
+        sqe->user_data = s;
+        switch(slot->op) {
+        case BULK_OPEN:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) slot->filename;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            break;
+        case BULK_HEADER:
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = slot->fd;
+            sqe->addr = (uintptr_t) (slot->buf + slot->buf_valid);
+            sqe->len = (uint32_t) read_size;
+            sqe->off = slot->buf_valid;
+            break;
+        case BULK_ADVISE:
+            sqe->opcode = IORING_OP_FADVISE;
+            sqe->fd = slot->fd;
+            sqe->off = slot->advise_offset;
+            sqe->len = (uint32_t) min(slot->advise_size, (uint64_t) UINT32_MAX);
+            sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+            break;
+        }
+        return;
+    }
+#endif
+    int result = 0;
+    switch(slot->op) {
+    case BULK_OPEN:
+        result = open(slot->filename, O_RDONLY | O_CLOEXEC);
+        if(result < 0) result = -errno;
+        break;
+    case BULK_HEADER: {
+        ssize_t got = pread(slot->fd, slot->buf + slot->buf_valid, read_size, (off_t) slot->buf_valid);
+        result = got < 0 ? -errno : (int) got;
+        break;
+    }
+    case BULK_ADVISE:
+#ifdef POSIX_FADV_WILLNEED
+        // this only starts the reads
+        result = -posix_fadvise(slot->fd, (off_t) slot->advise_offset, (off_t) slot->advise_size, POSIX_FADV_WILLNEED);
+#endif
+        break;
+    }
+    unsigned int i = (bulk->done_head + bulk->done_count++) % bulk->depth;
+    bulk->done_slots[i] = s;
+    bulk->done_results[i] = result;
+}
+
+static void bulk_wait(struct bulk *bulk, unsigned int *slot, int *result) {
+#ifdef BULK_URING
+    if(bulk->use_ring) {
+        while(!uring_reap(&bulk->ring, slot, result)) {
+            uring_enter(&bulk->ring, 1);
+        }
+        return;
+    }
+#endif
+    *slot = bulk->done_slots[bulk->done_head];
+    *result = bulk->done_results[bulk->done_head];
+    bulk->done_head = (bulk->done_head + 1) % bulk->depth;
+    bulk->done_count--;
+}
+
+static void bulk_flush(struct bulk *bulk) {
+#ifdef BULK_URING
+    if(bulk->use_ring) {
+        uring_enter(&bulk->ring, 0);
+    }
+#endif
+    (void) bulk;
+}
+
+// looks at what's been read of the header and decides what to do next: read more of the load commands,
+// prefetch, or nothing (returns false).  anything that looks wrong is left for b_prange_load_macho to complain about
+static bool bulk_next_op(struct bulk_slot *slot) {
+    if(slot->buf_valid < sizeof(uint32_t)) return false;
+    uint32_t magic = *(uint32_t *) slot->buf;
+    if(magic == FAT_CIGAM) {
+        // the thin header could be anywhere, so just get it all
+        slot->op = BULK_ADVISE;
+        slot->advise_offset = 0;
+        slot->advise_size = slot->file_size;
+        return true;
+    }
+    if(magic != MH_MAGIC && magic != MH_MAGIC_64) return false;
+    size_t header_size = magic == MH_MAGIC_64 ? sizeof(struct mach_header_64) : sizeof(struct mach_header);
+    if(slot->buf_valid < header_size) return false;
+    struct mach_header *hdr = (void *) slot->buf;
+    uint64_t cmds_end = header_size + (uint64_t) hdr->sizeofcmds;
+    if(cmds_end > slot->file_size) return false;
+    if(cmds_end > slot->buf_valid) {
+        if(slot->buf_valid < slot->buf_size) {
+            // short read
+            return false;
+        }
+        slot->buf_size = (size_t) cmds_end;
+        slot->buf = realloc(slot->buf, slot->buf_size);
+        if(!slot->buf) {
+            die("out of memory");
+        }
+        slot->op = BULK_HEADER;
+        return true;
+    }
+
+    for(uint8_t *p = slot->buf + header_size, *end = slot->buf + cmds_end; end - p >= (ptrdiff_t) sizeof(struct load_command); ) {
+        struct load_command *cmd = (void *) p;
+        if(cmd->cmdsize < sizeof(struct load_command) || cmd->cmdsize > (size_t) (end - p)) break;
+        if(cmd->cmd == LC_SEGMENT && cmd->cmdsize >= sizeof(struct segment_command)) {
+            struct segment_command *seg = (void *) cmd;
+            if(!strncmp(seg->segname, "__LINKEDIT", 16)) {
+                slot->advise_offset = seg->fileoff;
+                slot->advise_size = seg->filesize;
+            }
+        } else if(cmd->cmd == LC_SEGMENT_64 && cmd->cmdsize >= sizeof(struct segment_command_64)) {
+            struct segment_command_64 *seg = (void *) cmd;
+            if(!strncmp(seg->segname, "__LINKEDIT", 16)) {
+                slot->advise_offset = seg->fileoff;
+                slot->advise_size = seg->filesize;
+            }
+        }
+        p += cmd->cmdsize;
+    }
+    if(!slot->advise_size || slot->advise_offset >= slot->file_size) return false;
+    slot->advise_size = min(slot->advise_size, slot->file_size - slot->advise_offset);
+    slot->op = BULK_ADVISE;
+    return true;
+}
+
+static void bulk_start(struct bulk *bulk, unsigned int s, size_t index, const char *filename) {
+    struct bulk_slot *slot = &bulk->slots[s];
+    slot->index = index;
+    slot->filename = filename;
+    slot->op = BULK_OPEN;
+    slot->fd = -1;
+    slot->buf_valid = 0;
+    slot->advise_offset = slot->advise_size = 0;
+    bulk_submit(bulk, s);
+}
+
+// handles a completion; returns true if the file is ready to load, or failed (*error set)
+static bool bulk_step(struct bulk *bulk, unsigned int s, int result, int *error) {
+    struct bulk_slot *slot = &bulk->slots[s];
+    *error = 0;
+    switch(slot->op) {
+    case BULK_OPEN: {
+        struct stat st;
+        if(result < 0) {
+            *error = -result;
+            return true;
+        }
+        slot->fd = result;
+        if(fstat(slot->fd, &st)) {
+            *error = errno;
+            return true;
+        }
+        slot->file_size = (uint64_t) st.st_size;
+        if(!slot->file_size) return true;
+        slot->op = BULK_HEADER;
+        if(slot->buf_size != HEADER_READ) {
+            free(slot->buf);
+            slot->buf_size = HEADER_READ;
+            slot->buf = malloc(slot->buf_size);
+            if(!slot->buf) {
+                die("out of memory");
+            }
+        }
+        slot->buf_size = (size_t) min((uint64_t) slot->buf_size, slot->file_size);
+        break;
+    }
+    case BULK_HEADER:
+        if(result < 0) {
+            *error = -result;
+            return true;
+        }
+        slot->buf_valid += (size_t) result;
+        if(!bulk_next_op(slot)) return true;
+        break;
+    case BULK_ADVISE:
+        // it's only a hint
+        return true;
+    }
+    bulk_submit(bulk, s);
+    return false;
+}
+
+static void bulk_load(int fd, int error, const char *filename, struct binary *binary) {
+#define _arg filename
+    if(error) {
+        errno = error;
+        edie("could not open");
+    }
+    prange_t pr = load_fd(fd, true);
+    b_own_mapping(binary, pr);
+    b_prange_load_macho(binary, pr, 0, filename);
+#undef _arg
+}
+
+static void bulk_finish(int fd, int error, size_t index, const char *filename, b_bulk_callback_t callback, void *ctx) {
+    struct binary binary;
+    struct data_status status;
+    b_init(&binary);
+    bool ok = DATA_TRY(&status, bulk_load(fd, error, filename, &binary));
+    if(fd != -1) {
+        close(fd);
+    }
+    callback(ctx, index, ok ? &binary : NULL, ok ? NULL : &status);
+    b_destroy(&binary);
+}
+
+void b_load_macho_bulk(const char *const *filenames, size_t count, unsigned int depth, b_bulk_callback_t callback, void *ctx) {
+    struct bulk bulk;
+    if(!depth) depth = DEFAULT_DEPTH;
+    depth = (unsigned int) min((size_t) depth, count);
+    if(!depth) return;
+    bulk.depth = depth;
+    bulk.slots = calloc(depth, sizeof(*bulk.slots));
+    bulk.done_slots = malloc(depth * sizeof(*bulk.done_slots));
+    bulk.done_results = malloc(depth * sizeof(*bulk.done_results));
+    if(!bulk.slots || !bulk.done_slots || !bulk.done_results) {
+        die("out of memory");
+    }
+    bulk.done_head = bulk.done_count = 0;
+#ifdef BULK_URING
+    bulk.use_ring = uring_init(&bulk.ring, depth);
+#endif
+
+    size_t next = 0, outstanding = 0;
+    for(unsigned int s = 0; s < depth; s++) {
+        bulk_start(&bulk, s, next, filenames[next]);
+        next++;
+        outstanding++;
+    }
+    while(outstanding) {
+        bulk_flush(&bulk);
+        unsigned int s;
+        int result, error;
+        bulk_wait(&bulk, &s, &result);
+        if(!bulk_step(&bulk, s, result, &error)) continue;
+
+        // take the file out of the slot and put the next one in before loading, so it's going meanwhile
+        struct bulk_slot *slot = &bulk.slots[s];
+        size_t index = slot->index;
+        const char *filename = slot->filename;
+        int fd = slot->fd;
+        if(next < count) {
+            bulk_start(&bulk, s, next, filenames[next]);
+            next++;
+        } else {
+            outstanding--;
+        }
+        bulk_flush(&bulk);
+
+        bulk_finish(fd, error, index, filename, callback, ctx);
+    }
+
+#ifdef BULK_URING
+    if(bulk.use_ring) {
+        uring_destroy(&bulk.ring);
+    }
+#endif
+    for(unsigned int s = 0; s < depth; s++) {
+        free(bulk.slots[s].buf);
+    }
+    free(bulk.slots);
+    free(bulk.done_slots);
+    free(bulk.done_results);
+}
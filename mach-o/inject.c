@@ -155,6 +155,7 @@ uint32_t b_macho_extend_cmds(struct binary *binary, size_t space) {
     #undef X
 
     binary->valid_range = pdup(binary->valid_range, ((binary->valid_range.size + 0xfff) & ~0xfff) + stuff_size, stuff_size);
+    b_own_mapping(binary, binary->valid_range);
     struct mach_header *hdr = binary->valid_range.start;
     struct segment_command *seg = (void *) (hdr + 1);
     struct section *sect = (void *) (seg + 1);
@@ -749,6 +750,7 @@ void b_inject_macho_binary(struct binary *target, const struct binary *binary, a
 
     // finally, expand the binary in memory and actually copy in the new stuff
     target->valid_range = pdup(target->valid_range, seg_off, 0);
+    b_own_mapping(target, target->valid_range);
     for(unsigned i = 0; i < num_copies; i++) {
         memcpy(target->valid_range.start + copies[i].off, copies[i].start, copies[i].size);
     }
@@ -5,9 +5,110 @@
 #include "headers/arm_reloc.h"
 #include <ctype.h>
 #include "read_dyld_info.h"
+#include "../find.h"
 
-static addr_t lookup_symbol_or_do_stuff(lookupsym_t lookup_sym, void *context, const char *name, bool weak, bool userland) {
-    addr_t sym = lookup_sym(context, name);
+// Every symbol is looked up once: before relocating anything, we go through the relocations (or bind
+// opcodes) collecting the distinct names, resolve them in one lookupsyms_t call, and then the actual
+// relocation just reads them back out of here.
+struct sym_memo_entry {
+    const char *name; // in the binary, which isn't touched until the plan is applied
+    uint32_t hash;
+    bool resolved;
+    addr_t addr;
+};
+
+struct sym_memo {
+    struct sym_memo_entry *entries;
+    size_t capacity, count;
+    lookupsyms_t lookup_syms;
+    void *context;
+};
+
+static uint32_t memo_hash(const char *name) {
+    uint32_t hash = 2166136261;
+    while(*name) {
+        hash = (hash ^ (uint8_t) *name++) * 16777619;
+    }
+    return hash;
+}
+
+// the entry for name, or the empty one it would go in
+static struct sym_memo_entry *memo_slot(struct sym_memo_entry *entries, size_t capacity, const char *name, uint32_t hash) {
+    for(size_t i = hash & (capacity - 1); ; i = (i + 1) & (capacity - 1)) {
+        struct sym_memo_entry *entry = &entries[i];
+        if(!entry->name || (entry->hash == hash && !strcmp(entry->name, name))) {
+            return entry;
+        }
+    }
+}
+
+static struct sym_memo_entry *memo_add(struct sym_memo *memo, const char *name) {
+    if((memo->count + 1) * 2 > memo->capacity) {
+        size_t capacity = memo->capacity ? memo->capacity * 2 : 256;
+        struct sym_memo_entry *entries = calloc(capacity, sizeof(*entries));
+        if(!entries) {
+            die("out of memory");
+        }
+        for(size_t i = 0; i < memo->capacity; i++) {
+            struct sym_memo_entry *entry = &memo->entries[i];
+            if(entry->name) {
+                *memo_slot(entries, capacity, entry->name, entry->hash) = *entry;
+            }
+        }
+        free(memo->entries);
+        memo->entries = entries;
+        memo->capacity = capacity;
+    }
+    uint32_t hash = memo_hash(name);
+    struct sym_memo_entry *entry = memo_slot(memo->entries, memo->capacity, name, hash);
+    if(!entry->name) {
+        entry->name = name;
+        entry->hash = hash;
+        memo->count++;
+    }
+    return entry;
+}
+
+static void memo_resolve(struct sym_memo *memo) {
+    if(!memo->count) return;
+    autofree const char **names = malloc(memo->count * sizeof(*names));
+    autofree addr_t *addrs = malloc(memo->count * sizeof(*addrs));
+    autofree struct sym_memo_entry **which = malloc(memo->count * sizeof(*which));
+    if(!names || !addrs || !which) {
+        die("out of memory");
+    }
+    size_t n = 0;
+    for(size_t i = 0; i < memo->capacity; i++) {
+        struct sym_memo_entry *entry = &memo->entries[i];
+        if(entry->name && !entry->resolved) {
+            names[n] = entry->name;
+            addrs[n] = 0;
+            which[n++] = entry;
+        }
+    }
+    if(!n) return;
+    memo->lookup_syms(memo->context, names, addrs, n);
+    for(size_t i = 0; i < n; i++) {
+        which[i]->addr = addrs[i];
+        which[i]->resolved = true;
+    }
+}
+
+static addr_t memo_get(struct sym_memo *memo, const char *name) {
+    struct sym_memo_entry *entry = memo_add(memo, name);
+    if(!entry->resolved) {
+        // the collecting pass should have seen it, but this is still right if it didn't
+        memo_resolve(memo);
+    }
+    return entry->addr;
+}
+
+static void memo_free(struct sym_memo *memo) {
+    free(memo->entries);
+}
+
+static addr_t lookup_symbol_or_do_stuff(struct sym_memo *memo, const char *name, bool weak, bool userland) {
+    addr_t sym = memo_get(memo, name);
     if(!sym) {
         if(userland) {
             // let it pass
@@ -22,127 +123,485 @@ static addr_t lookup_symbol_or_do_stuff(lookupsym_t lookup_sym, void *context, c
     return sym;
 }
 
-static addr_t lookup_nth_symbol(const struct binary *load, uint32_t symbolnum, lookupsym_t lookup_sym, void *context, bool userland) {
+static const char *nth_symbol_name(const struct binary *load, uint32_t symbolnum, bool *weak) {
     struct nlist *nl = b_macho_nth_symbol(load, symbolnum);
-    bool weak = nl->n_desc & N_WEAK_REF;
-    const char *name = load->mach->strtab + nl->n_un.n_strx;
-    return lookup_symbol_or_do_stuff(lookup_sym, context, name, weak, userland);
+    *weak = nl->n_desc & N_WEAK_REF;
+    return load->mach->strtab + nl->n_un.n_strx;
+}
+
+static addr_t lookup_nth_symbol(const struct binary *load, uint32_t symbolnum, struct sym_memo *memo, bool userland) {
+    bool weak;
+    const char *name = nth_symbol_name(load, symbolnum, &weak);
+    return lookup_symbol_or_do_stuff(memo, name, weak, userland);
+}
+
+// Relocating is done in two steps: first everything that would be written is worked out into a plan (a
+// table of fixups, each an offset from valid_range.start and what to do there), without touching the binary,
+// and then the plan is applied.  The plan doesn't depend on the slide, so it can be applied again at another
+// one, to another copy.
+enum fixup_op {
+    // += slide, on value pointers in a row (never past the end of the page the first is on)
+    FIXUP_REBASE32,
+    FIXUP_REBASE64,
+    // = -(*p + slide), for REBASE_TYPE_TEXT_PCREL32
+    FIXUP_REBASE_NEGATE32,
+    // = value
+    FIXUP_SET32,
+    FIXUP_SET64,
+    // ARM_RELOC_VANILLA: += value (or the slide, for a local relocation) if it points into the binary
+    FIXUP_VANILLA,
+    FIXUP_VANILLA_LOCAL,
+    // ARM_RELOC_BR24, likewise
+    FIXUP_BR24,
+    FIXUP_BR24_LOCAL,
+    // blank out value bytes of bind opcodes that have been done, so they don't get bound again
+    FIXUP_ERASE_BIND,
+    // mark value relocation entries in a row done (r_address = 0, r_symbolnum = R_ABS)
+    FIXUP_RELOC_DONE,
+};
+// only if the slide isn't 0 (b_relocate doesn't rebase at all then)
+#define FIXUP_IF_SLID 0x80
+
+struct fixup {
+    size_t offset;
+    addr_t value;
+    uint8_t op;
+};
+
+struct plan_segment {
+    addr_t vm_start, file_start;
+    size_t file_size;
+};
+
+struct data_reloc_plan {
+    enum reloc_mode mode;
+    // of the valid_range it was made from
+    size_t size, header_offset;
+    struct fixup *fixups;
+    size_t count, capacity;
+    // the first nsorted are sorted by page and none of them writes past the page after the one it starts
+    // on, so they can be split between threads; the rest are done in order afterwards
+    size_t nsorted;
+    // for FIXUP_VANILLA's check
+    struct plan_segment *segments;
+    uint32_t nsegments;
+};
+
+// room for n more
+static void plan_reserve(struct data_reloc_plan *plan, size_t n) {
+    if(n <= plan->capacity - plan->count) return;
+    plan->capacity = max(plan->count + n, plan->capacity ? plan->capacity * 2 : 256);
+    plan->fixups = realloc(plan->fixups, plan->capacity * sizeof(*plan->fixups));
+    if(!plan->fixups) {
+        die("out of memory");
+    }
+}
+
+static inline void fixup_add(struct data_reloc_plan *plan, size_t offset, addr_t value, uint8_t op) {
+    plan_reserve(plan, 1);
+    plan->fixups[plan->count++] = (struct fixup) {offset, value, op};
+}
+
+static inline size_t plan_offset(const struct binary *load, const void *ptr) {
+    return (const char *) ptr - (const char *) load->valid_range.start;
+}
+
+static inline uint8_t pointer_op(const struct binary *load, bool set) {
+    return b_pointer_size(load) == 8 ? (set ? FIXUP_SET64 : FIXUP_REBASE64) : (set ? FIXUP_SET32 : FIXUP_REBASE32);
+}
+
+// these go after everything else, in order: the bind opcodes are erased last, as they always were, BR24 can
+// die (and nothing else writes to instructions anyway), and runs of relocation entries span pages
+static inline bool fixup_in_tail(const struct fixup *f) {
+    uint8_t op = f->op & ~FIXUP_IF_SLID;
+    return op == FIXUP_ERASE_BIND || op == FIXUP_BR24 || op == FIXUP_BR24_LOCAL || op == FIXUP_RELOC_DONE;
 }
 
-static void relocate_area(struct binary *load, uint32_t reloff, uint32_t nreloc, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide) {
+#define FIXUP_PAGE_SHIFT 12
+
+// the bucket a fixup sorts into: its page, or after all of them
+static inline size_t fixup_key(const struct data_reloc_plan *plan, const struct fixup *f) {
+    return fixup_in_tail(f) ? (plan->size >> FIXUP_PAGE_SHIFT) + 1 : f->offset >> FIXUP_PAGE_SHIFT;
+}
+
+// a counting sort by page, which is linear; it's stable, since fixups to the same address have to happen in
+// order (a rebase, then a bind over it), and within a page nothing else matters
+static void sort_fixups(struct data_reloc_plan *plan) {
+    struct fixup *fixups = plan->fixups;
+    size_t count = plan->count, nkeys = (plan->size >> FIXUP_PAGE_SHIFT) + 2, i;
+    // dyld info is usually sorted already
+    for(i = 1; i < count && fixup_key(plan, &fixups[i - 1]) <= fixup_key(plan, &fixups[i]); i++);
+    if(i >= count) return;
+
+    autofree size_t *starts = calloc(nkeys + 1, sizeof(*starts));
+    autofree struct fixup *tmp = malloc(count * sizeof(*tmp));
+    if(!starts || !tmp) {
+        die("out of memory");
+    }
+    for(i = 0; i < count; i++) {
+        starts[fixup_key(plan, &fixups[i]) + 1]++;
+    }
+    for(size_t k = 1; k <= nkeys; k++) {
+        starts[k] += starts[k - 1];
+    }
+    for(i = 0; i < count; i++) {
+        tmp[starts[fixup_key(plan, &fixups[i])]++] = fixups[i];
+    }
+    memcpy(fixups, tmp, count * sizeof(*fixups));
+}
+
+// how many bytes a fixup in the sorted part might touch
+static inline size_t fixup_span(const struct fixup *f) {
+    switch(f->op & ~FIXUP_IF_SLID) {
+    case FIXUP_REBASE32:
+        return f->value * sizeof(uint32_t);
+    case FIXUP_REBASE64:
+        return f->value * sizeof(uint64_t);
+    default:
+        return sizeof(uint64_t);
+    }
+}
+
+// whether the sorted fixups can be split between threads before i: between two pages, as long as nothing on
+// the first (an unaligned pointer) hangs over into the second
+static bool fixup_can_split(const struct fixup *fixups, size_t i) {
+    size_t page = fixups[i].offset >> FIXUP_PAGE_SHIFT, prev = fixups[i - 1].offset >> FIXUP_PAGE_SHIFT;
+    if(prev == page) return false;
+    for(size_t j = i; j-- > 0 && fixups[j].offset >> FIXUP_PAGE_SHIFT == prev; ) {
+        if((fixups[j].offset + fixup_span(&fixups[j]) - 1) >> FIXUP_PAGE_SHIFT >= page) return false;
+    }
+    return true;
+}
+
+// sorts the plan and marks the part that can be split up
+static void finish_plan(struct data_reloc_plan *plan) {
+    sort_fixups(plan);
+    for(plan->nsorted = 0; plan->nsorted < plan->count && !fixup_in_tail(&plan->fixups[plan->nsorted]); plan->nsorted++);
+}
+
+// what rangeconv((range_t) {load, addr, 0}, 0) says, without the binary; like rangeconv, it tries the segment
+// it found last time first
+static bool plan_points_in(const struct data_reloc_plan *plan, addr_t addr, uint32_t *hint) {
+    for(uint32_t n = 0; n <= plan->nsegments; n++) {
+        uint32_t i = n ? n - 1 : *hint;
+        if(i >= plan->nsegments || (n && i == *hint)) continue;
+        const struct plan_segment *seg = &plan->segments[i];
+        addr_t diff = addr - seg->vm_start;
+        if(diff < seg->file_size) {
+            *hint = i;
+            addr_t offset = seg->file_start + diff;
+            if(offset == 0 && plan->header_offset) offset = plan->header_offset;
+            return offset <= plan->size;
+        }
+    }
+    return false;
+}
+
+static void apply_br24(uint32_t *p, addr_t value, addr_t slide) {
+    uint32_t ins = *p;
+    uint32_t off = ins & 0x00ffffff;
+    if(ins & 0x00800000) off |= 0xff000000;
+    off <<= 2;
+    off += (value - slide);
+    if((off & 0xfc000000) != 0 &&
+       (off & 0xfc000000) != 0xfc000000) {
+        die("BR24 relocation out of range");
+    }
+    uint32_t cond = ins >> 28;
+    if(value & 1) {
+        if(cond != 0xe && cond != 0xf) die("can't convert BL with condition to BLX (which must be unconditional)");
+        ins = (ins & 0x0effffff) | 0xf0000000 | ((off & 2) << 24);
+    } else if(cond == 0xf) {
+        ins = (ins & 0x0fffffff) | 0xe0000000;
+    }
+
+    ins = (ins & 0xff000000) | ((off >> 2) & 0x00ffffff);
+    *p = ins;
+}
+
+// runs of pointers to rebase are usually long (vtables, sysctl tables, ObjC metadata), so they're done a
+// vector at a time
+typedef uint32_t rebase_vec32 __attribute__((vector_size(16)));
+typedef uint64_t rebase_vec64 __attribute__((vector_size(16)));
+
+static void rebase_run32(uint32_t *p, size_t count, uint32_t slide) {
+    rebase_vec32 add = {slide, slide, slide, slide};
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8) {
+        rebase_vec32 a, b;
+        memcpy(&a, p + i, sizeof(a));
+        memcpy(&b, p + i + 4, sizeof(b));
+        a += add;
+        b += add;
+        memcpy(p + i, &a, sizeof(a));
+        memcpy(p + i + 4, &b, sizeof(b));
+    }
+    for(; i < count; i++) {
+        p[i] += slide;
+    }
+}
+
+static void rebase_run64(uint64_t *p, size_t count, uint64_t slide) {
+    rebase_vec64 add = {slide, slide};
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        rebase_vec64 a, b;
+        memcpy(&a, p + i, sizeof(a));
+        memcpy(&b, p + i + 2, sizeof(b));
+        a += add;
+        b += add;
+        memcpy(p + i, &a, sizeof(a));
+        memcpy(p + i + 2, &b, sizeof(b));
+    }
+    for(; i < count; i++) {
+        p[i] += slide;
+    }
+}
+
+// each fixup is done to every copy before going on to the next, so the plan is only read once however many
+// copies there are.  only BR24 can die, and those aren't in the sorted part
+static void apply_fixups(const struct data_reloc_plan *plan, char *const *bases, const addr_t *slides, size_t ncopies, size_t from, size_t to) {
+    uint32_t hint = 0;
+    for(size_t i = from; i < to; i++) {
+        const struct fixup *f = &plan->fixups[i];
+        for(size_t c = 0; c < ncopies; c++) {
+            void *p = bases[c] + f->offset;
+            addr_t slide = slides[c];
+            if((f->op & FIXUP_IF_SLID) && !slide) continue;
+            switch(f->op & ~FIXUP_IF_SLID) {
+            case FIXUP_REBASE32:
+                rebase_run32(p, (size_t) f->value, (uint32_t) slide);
+                break;
+            case FIXUP_REBASE64:
+                rebase_run64(p, (size_t) f->value, slide);
+                break;
+            case FIXUP_REBASE_NEGATE32:
+                *(uint32_t *) p = -(*(uint32_t *) p + (uint32_t) slide);
+                break;
+            case FIXUP_SET32:
+                *(uint32_t *) p = (uint32_t) f->value;
+                break;
+            case FIXUP_SET64:
+                *(uint64_t *) p = f->value;
+                break;
+            case FIXUP_VANILLA:
+            case FIXUP_VANILLA_LOCAL:
+                if(plan_points_in(plan, *(uint32_t *) p, &hint)) {
+                    // when dyld_stub_binding_helper (which would just crash, btw) is present, entries in the indirect section point to it; usually this increments to point to the right dyld_stub_binding_helper, then that's clobbered by the indirect code.  when we do prelinking, the indirect code runs first and we would be relocating the already-correctly-located importee symbol, so we add this check (easier than actually checking that it's not in the indirect section) to make sure we're not relocating nonsense.
+                    *(uint32_t *) p += (uint32_t) ((f->op & ~FIXUP_IF_SLID) == FIXUP_VANILLA ? f->value : slide);
+                }
+                break;
+            case FIXUP_BR24:
+                apply_br24(p, f->value, slide);
+                break;
+            case FIXUP_BR24_LOCAL:
+                // *shrug*
+                apply_br24(p, slide, slide);
+                break;
+            case FIXUP_ERASE_BIND:
+                memset(p, BIND_OPCODE_SET_TYPE_IMM, (size_t) f->value);
+                break;
+            case FIXUP_RELOC_DONE:
+                for(struct relocation_info *r = p, *end = r + f->value; r != end; r++) {
+                    r->r_address = 0;
+                    r->r_symbolnum = R_ABS;
+                }
+                break;
+            }
+        }
+    }
+}
+
+#define FIXUP_CHUNK_MIN 0x2000
+
+struct fixup_apply {
+    const struct data_reloc_plan *plan;
+    char *const *bases;
+    const addr_t *slides;
+    size_t ncopies;
+    size_t *bounds;
+};
+
+static void fixup_apply_chunk(void *ctx, unsigned int i) {
+    struct fixup_apply *fa = ctx;
+    apply_fixups(fa->plan, fa->bases, fa->slides, fa->ncopies, fa->bounds[i], fa->bounds[i + 1]);
+}
+
+static void apply_plan(const struct data_reloc_plan *plan, char *const *bases, const addr_t *slides, size_t ncopies) {
+    unsigned int threads = data_threads(), nchunks = 0;
+    size_t count = plan->nsorted;
+    if(threads <= 1 || count < 2 * FIXUP_CHUNK_MIN) {
+        apply_fixups(plan, bases, slides, ncopies, 0, plan->count);
+        return;
+    }
+    size_t chunk_size = max(count / (4 * threads), (size_t) FIXUP_CHUNK_MIN);
+    autofree size_t *bounds = malloc((count / chunk_size + 2) * sizeof(*bounds));
+    if(!bounds) {
+        die("out of memory");
+    }
+    // split only between pages, so no two threads write to the same one
+    const struct fixup *fixups = plan->fixups;
+    bounds[0] = 0;
+    for(size_t i = chunk_size; i < count; ) {
+        while(i < count && !fixup_can_split(fixups, i)) i++;
+        if(i >= count) break;
+        bounds[++nchunks] = i;
+        i += chunk_size;
+    }
+    bounds[++nchunks] = count;
+    struct fixup_apply fa = {plan, bases, slides, ncopies, bounds};
+    data_parallel(nchunks, fixup_apply_chunk, &fa);
+    apply_fixups(plan, bases, slides, ncopies, count, plan->count);
+}
+
+static void collect_area(const struct binary *load, uint32_t reloff, uint32_t nreloc, struct sym_memo *memo) {
     struct relocation_info *things = rangeconv_off((range_t) {load, reloff, nreloc * sizeof(struct relocation_info)}, MUST_FIND).start;
+    for(uint32_t i = 0; i < nreloc; i++) {
+        if(things[i].r_address == 0 || things[i].r_symbolnum == R_ABS || !things[i].r_extern) continue;
+        bool weak;
+        memo_add(memo, nth_symbol_name(load, things[i].r_symbolnum, &weak));
+    }
+}
+
+// what relocations are relative to, and the segment the last one was in: worked out once, instead of per
+// relocation
+struct reloc_cursor {
+    bool have_base;
+    addr_t base;
+    const struct data_segment *seg;
+};
+
+// rangeconv((range_t) {load, cursor->base + address, 4}, MUST_FIND).start
+static uint32_t *reloc_target(const struct binary *load, struct reloc_cursor *cursor, addr_t address) {
+    if(!cursor->have_base) {
+        cursor->base = b_macho_reloc_base(load);
+        cursor->have_base = true;
+    }
+    address += cursor->base;
+    const struct data_segment *seg = cursor->seg;
+    if(!seg || address - seg->vm_range.start >= seg->file_range.size) {
+        for(seg = load->segments; seg != load->segments + load->nsegments; seg++) {
+            if(address - seg->vm_range.start < seg->file_range.size) break;
+        }
+        if(seg == load->segments + load->nsegments) {
+            return rangeconv((range_t) {load, address, 4}, MUST_FIND).start;
+        }
+        cursor->seg = seg;
+    }
+    return rangeconv_off((range_t) {load, seg->file_range.start + (address - seg->vm_range.start), 4}, MUST_FIND).start;
+}
+
+static void plan_area(const struct binary *load, uint32_t reloff, uint32_t nreloc, enum reloc_mode mode, struct sym_memo *memo, struct reloc_cursor *cursor, struct data_reloc_plan *plan) {
+    struct relocation_info *things = rangeconv_off((range_t) {load, reloff, nreloc * sizeof(struct relocation_info)}, MUST_FIND).start;
+    // the FIXUP_RELOC_DONE for the entries right before this one, if they were done
+    size_t done_run = SIZE_MAX;
+    plan_reserve(plan, nreloc);
     for(uint32_t i = 0; i < nreloc; i++) {
         if(things[i].r_length != 2) {
             die("bad relocation length");
         }
         addr_t address = things[i].r_address;
         if(address == 0 || things[i].r_symbolnum == R_ABS) continue;
-        address += b_macho_reloc_base(load);
-        uint32_t *p = rangeconv((range_t) {load, address, 4}, MUST_FIND).start;
+        uint32_t *p = reloc_target(load, cursor, address);
 
-        addr_t value;
+        addr_t value = 0;
         if(things[i].r_extern) {
             if(mode == RELOC_LOCAL_ONLY) continue;
-            value = lookup_nth_symbol(load, things[i].r_symbolnum, lookup_sym, context, mode == RELOC_USERLAND);
+            value = lookup_nth_symbol(load, things[i].r_symbolnum, memo, mode == RELOC_USERLAND);
             if(value == 0 && mode == RELOC_USERLAND) continue;
         } else {
             if(mode == RELOC_EXTERN_ONLY || mode == RELOC_USERLAND) continue;
-            // *shrug*
-            value = slide;
         }
 
-        things[i].r_address = 0;
-        things[i].r_symbolnum = R_ABS;
-
         if(mode == RELOC_EXTERN_ONLY && things[i].r_type != ARM_RELOC_VANILLA) {
             die("non-VANILLA relocation but we are relocating without knowing the slide; use __attribute__((long_call)) to get rid of these");
         }
+        uint8_t op;
         switch(things[i].r_type) {
         case ARM_RELOC_VANILLA:
-            //printf("%x, %x += %x\n", address, *p, value); 
-            if(rangeconv((range_t) {load, *p, 0}, 0).start) {
-                // when dyld_stub_binding_helper (which would just crash, btw) is present, entries in the indirect section point to it; usually this increments to point to the right dyld_stub_binding_helper, then that's clobbered by the indirect code.  when we do prelinking, the indirect code runs first and we would be relocating the already-correctly-located importee symbol, so we add this check (easier than actually checking that it's not in the indirect section) to make sure we're not relocating nonsense.
-                *p += value;
-            }
-            //else printf("skipping %x\n", *p);
+            op = things[i].r_extern ? FIXUP_VANILLA : FIXUP_VANILLA_LOCAL;
             break;
-        case ARM_RELOC_BR24: {
+        case ARM_RELOC_BR24:
             if(!things[i].r_pcrel) die("weird relocation");
-            uint32_t ins = *p;
-            uint32_t off = ins & 0x00ffffff;
-            if(ins & 0x00800000) off |= 0xff000000;
-            off <<= 2;
-            off += (value - slide);
-            if((off & 0xfc000000) != 0 &&
-               (off & 0xfc000000) != 0xfc000000) {
-                die("BR24 relocation out of range");
-            }
-            uint32_t cond = ins >> 28;
-            if(value & 1) {
-                if(cond != 0xe && cond != 0xf) die("can't convert BL with condition to BLX (which must be unconditional)");
-                ins = (ins & 0x0effffff) | 0xf0000000 | ((off & 2) << 24);
-            } else if(cond == 0xf) {
-                ins = (ins & 0x0fffffff) | 0xe0000000;
-            }
-
-            ins = (ins & 0xff000000) | ((off >> 2) & 0x00ffffff);
-            *p = ins;
+            op = things[i].r_extern ? FIXUP_BR24 : FIXUP_BR24_LOCAL;
             break;
-        }
         default:
             die("unknown relocation type %d", things[i].r_type);
         }
+        fixup_add(plan, plan_offset(load, p), value, op);
 
+        // and mark it done
+        if(done_run != SIZE_MAX && plan_offset(load, &things[i]) == plan->fixups[done_run].offset + plan->fixups[done_run].value * sizeof(*things)) {
+            plan->fixups[done_run].value++;
+        } else {
+            done_run = plan->count;
+            fixup_add(plan, plan_offset(load, &things[i]), 1, FIXUP_RELOC_DONE);
+        }
     }
 }
 
-static void go_indirect(struct binary *load, uint32_t offset, uint32_t size, uint32_t flags, uint32_t reserved1, uint32_t reserved2, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide) {
-    uint8_t type = flags & SECTION_TYPE;
+// the indirect symbol table entries for a section of symbol pointers
+static uint32_t *indirect_table(const struct binary *load, uint32_t size, uint8_t type, uint32_t reserved1, uint32_t reserved2, uint32_t *num_syms, uint32_t *stride) {
     uint8_t pointer_size = b_pointer_size(load);
+    uint32_t indirect_table_offset = reserved1;
+    const struct dysymtab_command *dysymtab = load->mach->dysymtab;
+
+    *stride = type == S_SYMBOL_STUBS ? reserved2 : pointer_size;
+    *num_syms = size / *stride;
+
+    if(*stride < pointer_size ||
+       *num_syms * *stride != size ||
+       dysymtab->nindirectsyms > ((addr_t) -(dysymtab->indirectsymoff - 1)) / sizeof(uint32_t) ||
+       indirect_table_offset > dysymtab->nindirectsyms ||
+       *num_syms > dysymtab->nindirectsyms - indirect_table_offset) {
+       die("bad indirect section");
+    }
+
+    return rangeconv_off((range_t) {load, (addr_t) dysymtab->indirectsymoff + indirect_table_offset * sizeof(uint32_t), *num_syms * sizeof(uint32_t)}, MUST_FIND).start;
+}
+
+static void collect_indirect(const struct binary *load, uint32_t size, uint32_t flags, uint32_t reserved1, uint32_t reserved2, struct sym_memo *memo) {
+    uint8_t type = flags & SECTION_TYPE;
+    if(type != S_NON_LAZY_SYMBOL_POINTERS && type != S_LAZY_SYMBOL_POINTERS) return;
+    uint32_t num_syms, stride;
+    uint32_t *indirect_syms = indirect_table(load, size, type, reserved1, reserved2, &num_syms, &stride);
+    for(uint32_t i = 0; i < num_syms; i++) {
+        if(indirect_syms[i] == INDIRECT_SYMBOL_LOCAL || indirect_syms[i] == INDIRECT_SYMBOL_ABS) continue;
+        bool weak;
+        memo_add(memo, nth_symbol_name(load, indirect_syms[i], &weak));
+    }
+}
+
+static void plan_indirect(const struct binary *load, uint32_t offset, uint32_t size, uint32_t flags, uint32_t reserved1, uint32_t reserved2, enum reloc_mode mode, struct sym_memo *memo, struct data_reloc_plan *plan) {
+    uint8_t type = flags & SECTION_TYPE;
     switch(type) {
     case S_NON_LAZY_SYMBOL_POINTERS:
     case S_LAZY_SYMBOL_POINTERS: {
-        uint32_t indirect_table_offset = reserved1;
-        const struct dysymtab_command *dysymtab = load->mach->dysymtab;
-        
-
-        uint32_t stride = type == S_SYMBOL_STUBS ? reserved2 : pointer_size;
-        uint32_t num_syms = size / stride;
-
-        if(stride < pointer_size ||
-           num_syms * stride != size ||
-           dysymtab->nindirectsyms > ((addr_t) -(dysymtab->indirectsymoff - 1)) / sizeof(uint32_t) ||
-           indirect_table_offset > dysymtab->nindirectsyms ||
-           num_syms > dysymtab->nindirectsyms - indirect_table_offset) {
-           die("bad indirect section");
-        }
-        
-        uint32_t *indirect_syms = rangeconv_off((range_t) {load, (addr_t) dysymtab->indirectsymoff + indirect_table_offset * sizeof(uint32_t), num_syms * sizeof(uint32_t)}, MUST_FIND).start;
-        void *addrs = rangeconv_off((range_t) {load, offset, size}, MUST_FIND).start;
+        uint32_t num_syms, stride;
+        uint32_t *indirect_syms = indirect_table(load, size, type, reserved1, reserved2, &num_syms, &stride);
+        char *addrs = rangeconv_off((range_t) {load, offset, size}, MUST_FIND).start;
         for(uint32_t i = 0; i < num_syms; i++, indirect_syms++, addrs += stride) {
-            addr_t addr, found_addr;
+            addr_t found_addr;
 
             switch(*indirect_syms) {
             case INDIRECT_SYMBOL_LOCAL:
                 if(mode == RELOC_EXTERN_ONLY || mode == RELOC_USERLAND) continue;
-                addr = read_pointer(addrs, pointer_size) + slide;
+                fixup_add(plan, plan_offset(load, addrs), 1, pointer_op(load, false));
                 break;
             case INDIRECT_SYMBOL_ABS:
                 continue;
             default:
                 if(mode == RELOC_LOCAL_ONLY) continue;
-                found_addr = lookup_nth_symbol(load, *indirect_syms, lookup_sym, context, mode == RELOC_USERLAND);
+                found_addr = lookup_nth_symbol(load, *indirect_syms, memo, mode == RELOC_USERLAND);
                 if(!found_addr && mode == RELOC_USERLAND) {
                     // don't set to ABS! 
                     continue;
                 }
-
-                addr = found_addr;
+                fixup_add(plan, plan_offset(load, addrs), found_addr, pointer_op(load, true));
                 break;
             }
 
-            write_pointer(addrs, addr, pointer_size);
-            *indirect_syms = INDIRECT_SYMBOL_ABS;
+            fixup_add(plan, plan_offset(load, indirect_syms), INDIRECT_SYMBOL_ABS, FIXUP_SET32);
         }
         break;
     }
@@ -163,12 +622,29 @@ static void go_indirect(struct binary *load, uint32_t offset, uint32_t size, uin
     
 }
 
-static void relocate_with_symtab(struct binary *load, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide) {
+static void collect_with_symtab(const struct binary *load, struct sym_memo *memo) {
+    collect_area(load, load->mach->dysymtab->extreloff, load->mach->dysymtab->nextrel, memo);
+    CMD_ITERATE(b_mach_hdr(load), cmd) {
+        MACHO_SPECIALIZE(
+            if(cmd->cmd == LC_SEGMENT_X) {
+                segment_command_x *seg = (void *) cmd;
+                section_x *sect = (void *) (seg + 1);
+                for(uint32_t i = 0; i < seg->nsects; i++, sect++) {
+                    collect_indirect(load, sect->size, sect->flags, sect->reserved1, sect->reserved2, memo);
+                    collect_area(load, sect->reloff, sect->nreloc, memo);
+                }
+            }
+        )
+    }
+}
+
+static void plan_with_symtab(const struct binary *load, enum reloc_mode mode, struct sym_memo *memo, struct data_reloc_plan *plan) {
+    struct reloc_cursor cursor = {false, 0, NULL};
     if(mode != RELOC_EXTERN_ONLY && mode != RELOC_USERLAND) {
-        relocate_area(load, load->mach->dysymtab->locreloff, load->mach->dysymtab->nlocrel, mode, lookup_sym, context, slide);
+        plan_area(load, load->mach->dysymtab->locreloff, load->mach->dysymtab->nlocrel, mode, memo, &cursor, plan);
     }
     if(mode != RELOC_LOCAL_ONLY) {
-        relocate_area(load, load->mach->dysymtab->extreloff, load->mach->dysymtab->nextrel, mode, lookup_sym, context, slide);
+        plan_area(load, load->mach->dysymtab->extreloff, load->mach->dysymtab->nextrel, mode, memo, &cursor, plan);
     }
 
     CMD_ITERATE(b_mach_hdr(load), cmd) {
@@ -179,16 +655,56 @@ static void relocate_with_symtab(struct binary *load, enum reloc_mode mode, look
                 section_x *sect = (void *) (seg + 1);
                 for(uint32_t i = 0; i < seg->nsects; i++, sect++) {
                     //printf("   %.16s\n", sect->sectname);
-                    go_indirect(load, sect->offset, sect->size, sect->flags, sect->reserved1, sect->reserved2, mode, lookup_sym, context, slide);
-                    relocate_area(load, sect->reloff, sect->nreloc, mode, lookup_sym, context, slide);
+                    plan_indirect(load, sect->offset, sect->size, sect->flags, sect->reserved1, sect->reserved2, mode, memo, plan);
+                    plan_area(load, sect->reloff, sect->nreloc, mode, memo, &cursor, plan);
                 }
             }
         )
     }
+}
 
+// just the names that decode_binds will bind; anything it would complain about is skipped
+static void collect_binds(prange_t opcodes, struct sym_memo *memo) {
+    const char *sym = NULL;
+    void *ptr = opcodes.start, *end = ptr + opcodes.size;
+    while(ptr != end) {
+        uint8_t byte = read_int(&ptr, end, uint8_t);
+        switch(byte & BIND_OPCODE_MASK) {
+        case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+        case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+        case BIND_OPCODE_ADD_ADDR_ULEB:
+            read_uleb128(&ptr, end);
+            break;
+        case BIND_OPCODE_SET_ADDEND_SLEB:
+            read_sleb128(&ptr, end);
+            break;
+        case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+            sym = read_cstring(&ptr, end);
+            break;
+        case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB:
+            read_uleb128(&ptr, end);
+            // fall through
+        case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+            read_uleb128(&ptr, end);
+            // fall through
+        case BIND_OPCODE_DO_BIND:
+        case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+            if(sym) {
+                memo_add(memo, sym);
+            }
+            break;
+        case BIND_OPCODE_DONE:
+        case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+        case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+        case BIND_OPCODE_SET_TYPE_IMM:
+            break;
+        default:
+            return;
+        }
+    }
 }
 
-static void do_bind_section(prange_t opcodes, struct binary *load, bool weak, bool userland, lookupsym_t lookup_sym, void *context) {
+static void decode_binds(prange_t opcodes, const struct binary *load, bool weak, bool userland, struct sym_memo *memo, struct data_reloc_plan *plan) {
     uint8_t pointer_size = b_pointer_size(load);
 
     uint8_t symbol_flags;
@@ -263,7 +779,7 @@ static void do_bind_section(prange_t opcodes, struct binary *load, bool weak, bo
             addr_t value;
 
 
-            value = lookup_symbol_or_do_stuff(lookup_sym, context, sym, weak, userland);
+            value = lookup_symbol_or_do_stuff(memo, sym, weak, userland);
             if(!value) {
                 offset += stride * count;
                 break;
@@ -290,18 +806,14 @@ static void do_bind_section(prange_t opcodes, struct binary *load, bool weak, bo
                die("bad address while binding");
             }
 
+            size_t base = plan_offset(load, segment.start);
             while(count--) {
-                if(_64b) {
-                    *((uint64_t *) (segment.start + offset)) = value;
-                } else {
-                    *((uint32_t *) (segment.start + offset)) = value;
-                }
-
+                fixup_add(plan, base + offset, value, _64b ? FIXUP_SET64 : FIXUP_SET32);
                 offset += stride;
                 if(type == BIND_TYPE_TEXT_PCREL32) value += stride;
             }
 
-            memset(orig_ptr, BIND_OPCODE_SET_TYPE_IMM, ptr - orig_ptr);
+            fixup_add(plan, plan_offset(load, orig_ptr), ptr - orig_ptr, FIXUP_ERASE_BIND);
             type = BIND_TYPE_POINTER;
             break;    
         }
@@ -311,7 +823,36 @@ static void do_bind_section(prange_t opcodes, struct binary *load, bool weak, bo
     }
 }
 
-static void do_rebase(struct binary *load, prange_t opcodes, addr_t slide) {
+// adds count rebases stride apart.  pointers right after each other become runs, a page at a time, and carry
+// on the last fixup if it's the same run
+static void rebase_add(struct data_reloc_plan *plan, size_t offset, addr_t count, addr_t stride, uint8_t op) {
+    size_t width = op == FIXUP_REBASE64 ? sizeof(uint64_t) : sizeof(uint32_t);
+    while(count) {
+        if(op == FIXUP_REBASE_NEGATE32) {
+            fixup_add(plan, offset, 0, op | FIXUP_IF_SLID);
+            offset += stride;
+            count--;
+            continue;
+        }
+        addr_t n = 1;
+        if(stride == width) {
+            size_t left = (((offset >> FIXUP_PAGE_SHIFT) + 1) << FIXUP_PAGE_SHIFT) - offset;
+            n = max(min(count, (addr_t) (left / width)), (addr_t) 1);
+        }
+        struct fixup *last = plan->count ? &plan->fixups[plan->count - 1] : NULL;
+        if(last && last->op == (op | FIXUP_IF_SLID) &&
+           last->offset + fixup_span(last) == offset &&
+           last->offset >> FIXUP_PAGE_SHIFT == offset >> FIXUP_PAGE_SHIFT) {
+            last->value += n;
+        } else {
+            fixup_add(plan, offset, n, op | FIXUP_IF_SLID);
+        }
+        offset += n * stride;
+        count -= n;
+    }
+}
+
+static void decode_rebases(const struct binary *load, prange_t opcodes, struct data_reloc_plan *plan) {
     uint8_t pointer_size = b_pointer_size(load);
     uint8_t type = REBASE_TYPE_POINTER;
     addr_t offset = 0;
@@ -326,7 +867,7 @@ static void do_rebase(struct binary *load, prange_t opcodes, addr_t slide) {
         addr_t count, stride;
 
         switch(opcode) {
-        // this code is very similar to do_bind_section
+        // this code is very similar to decode_binds
         case REBASE_OPCODE_DONE:
             return;
         case REBASE_OPCODE_SET_TYPE_IMM:
@@ -362,14 +903,17 @@ static void do_rebase(struct binary *load, prange_t opcodes, addr_t slide) {
             stride = read_uleb128(&ptr, end) + pointer_size;
             goto rebase;
         rebase: {
-            bool _64b;
+            uint8_t op;
             switch(type) {
             case REBASE_TYPE_POINTER:
-                _64b = pointer_size == 8;
+                op = pointer_size == 8 ? FIXUP_REBASE64 : FIXUP_REBASE32;
                 break;
             case REBASE_TYPE_TEXT_ABSOLUTE32:
+                op = FIXUP_REBASE32;
+                break;
             case REBASE_TYPE_TEXT_PCREL32:
-                _64b = false;
+                // WTF!?  This is actually what dyld does.
+                op = FIXUP_REBASE_NEGATE32;
                 break;
             default:
                 die("bad rebase type %d", (int) type);
@@ -379,20 +923,8 @@ static void do_rebase(struct binary *load, prange_t opcodes, addr_t slide) {
                die("bad address while rebasing");
             }
 
-            while(count--) {
-                if(_64b) {
-                    *((uint64_t *) (segment.start + offset)) += slide;
-                } else {
-                    uint32_t *ptr = segment.start + offset;
-                    *ptr += slide;
-                    if(type == REBASE_TYPE_TEXT_PCREL32) {
-                        // WTF!?  This is actually what dyld does.
-                        *ptr = -*ptr;
-                    }
-                }
-
-                offset += stride;
-            }
+            rebase_add(plan, plan_offset(load, segment.start) + offset, count, stride, op);
+            offset += count * stride;
             break;
         }
         default:
@@ -401,15 +933,16 @@ static void do_rebase(struct binary *load, prange_t opcodes, addr_t slide) {
     }
 }
 
-static void relocate_with_dyld_info(struct binary *load, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide) {
+#define fetch(type) prange_t type = dyld_info->type##_off ? rangeconv_off((range_t) {load, dyld_info->type##_off, dyld_info->type##_size}, MUST_FIND) : (prange_t) {NULL, 0};
+
+static void plan_with_dyld_info(const struct binary *load, enum reloc_mode mode, struct sym_memo *memo, struct data_reloc_plan *plan, bool rebase) {
     // It gets more complicated
     struct dyld_info_command *dyld_info = load->mach->dyld_info;
-    #define fetch(type) prange_t type = dyld_info->type##_off ? rangeconv_off((range_t) {load, dyld_info->type##_off, dyld_info->type##_size}, MUST_FIND) : (prange_t) {NULL, 0};
 
-    if(mode != RELOC_EXTERN_ONLY && slide != 0) {
+    rebase = rebase && mode != RELOC_EXTERN_ONLY;
+    if(rebase) {
         fetch(rebase)
-        do_rebase(load, rebase, slide);
-        dyld_info->rebase_size = 0;
+        decode_rebases(load, rebase, plan);
     }
 
     if(mode != RELOC_LOCAL_ONLY) {
@@ -417,20 +950,139 @@ static void relocate_with_dyld_info(struct binary *load, enum reloc_mode mode, l
         fetch(weak_bind)
         fetch(lazy_bind)
         bool userland = mode == RELOC_USERLAND;
-        do_bind_section(bind, load, userland, userland, lookup_sym, context);
-        do_bind_section(weak_bind, load, true, userland, lookup_sym, context);
-        do_bind_section(lazy_bind, load, userland, userland, lookup_sym, context);
+        decode_binds(bind, load, userland, userland, memo, plan);
+        decode_binds(weak_bind, load, true, userland, memo, plan);
+        decode_binds(lazy_bind, load, userland, userland, memo, plan);
     }
-}
 
-void b_relocate(struct binary *load, const struct binary *target, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide) {
-    if(mode == RELOC_USERLAND && slide != 0) {
-        die("sliding is not supported in userland mode");
+    if(rebase) {
+        fixup_add(plan, plan_offset(load, &dyld_info->rebase_size), 0, FIXUP_SET32 | FIXUP_IF_SLID);
     }
+}
 
+static void collect_with_dyld_info(const struct binary *load, struct sym_memo *memo) {
+    struct dyld_info_command *dyld_info = load->mach->dyld_info;
+    fetch(bind)
+    fetch(weak_bind)
+    fetch(lazy_bind)
+    collect_binds(bind, memo);
+    collect_binds(weak_bind, memo);
+    collect_binds(lazy_bind, memo);
+}
+
+// rebase is false when the slide is known to be 0, to skip decoding the rebases at all; sort is false when
+// the plan is only going to be applied once, by one thread
+static struct data_reloc_plan *make_plan(const struct binary *load, enum reloc_mode mode, lookupsyms_t lookup_syms, void *context, bool rebase, bool sort) {
     if(!load->mach->symtab || !load->mach->dysymtab) {
         die("no LC_SYMTAB/LC_DYSYMTAB");
     }
+    if(load->windows) {
+        die("can't relocate a windowed binary");
+    }
+
+    struct data_reloc_plan *plan = calloc(1, sizeof(*plan));
+    if(!plan || !(plan->segments = malloc(load->nsegments * sizeof(*plan->segments) + 1))) {
+        die("out of memory");
+    }
+    plan->mode = mode;
+    plan->size = load->valid_range.size;
+    plan->header_offset = load->header_offset;
+    for(uint32_t i = 0; i < load->nsegments; i++) {
+        const struct data_segment *seg = &load->segments[i];
+        plan->segments[i] = (struct plan_segment) {seg->vm_range.start, seg->file_range.start, seg->file_range.size};
+    }
+    plan->nsegments = load->nsegments;
+
+    struct sym_memo memo = {.lookup_syms = lookup_syms, .context = context};
+    if(mode != RELOC_LOCAL_ONLY) {
+        (load->mach->dyld_info ? collect_with_dyld_info : collect_with_symtab)(load, &memo);
+        memo_resolve(&memo);
+    }
+    if(load->mach->dyld_info) {
+        plan_with_dyld_info(load, mode, &memo, plan, rebase);
+    } else {
+        plan_with_symtab(load, mode, &memo, plan);
+    }
+    memo_free(&memo);
+
+    // relocations are in whatever order the linker left them (and dyld info mostly isn't far off); applying
+    // them a page at a time is kinder to the cache, and lets them be split between threads.  the sort is
+    // stable, so one that reads what an earlier one wrote (VANILLA after the indirect code, say) still comes
+    // after it
+    if(sort) {
+        finish_plan(plan);
+    }
+
+    if(mode != RELOC_EXTERN_ONLY) {
+        CMD_ITERATE(b_mach_hdr(load), cmd) {
+            MACHO_SPECIALIZE(
+                if(cmd->cmd == LC_SEGMENT_X) {
+                    segment_command_x *seg = (void *) cmd;
+                    section_x *sect = (void *) (seg + 1);
+                    fixup_add(plan, plan_offset(load, &seg->vmaddr), 1, pointer_op(load, false) | FIXUP_IF_SLID);
+                    for(uint32_t i = 0; i < seg->nsects; i++, sect++) {
+                        fixup_add(plan, plan_offset(load, &sect->addr), 1, pointer_op(load, false) | FIXUP_IF_SLID);
+                    }
+                }
+            )
+        }
+    }
+    return plan;
+}
+
+struct data_reloc_plan *b_relocation_plan(const struct binary *load, enum reloc_mode mode, lookupsyms_t lookup_syms, void *context) {
+    return make_plan(load, mode, lookup_syms, context, true, true);
+}
+
+void b_relocation_plan_apply(const struct data_reloc_plan *plan, prange_t copy, addr_t slide) {
+    b_relocation_plan_apply_many(plan, &copy, &slide, 1);
+}
+
+void b_relocation_plan_apply_many(const struct data_reloc_plan *plan, const prange_t *copies, const addr_t *slides, size_t count) {
+    autofree char **bases = malloc(count * sizeof(*bases) + 1);
+    if(!bases) {
+        die("out of memory");
+    }
+    for(size_t i = 0; i < count; i++) {
+        if(plan->mode == RELOC_USERLAND && slides[i] != 0) {
+            die("sliding is not supported in userland mode");
+        }
+        if(copies[i].size != plan->size) {
+            die("relocation plan is for %zu bytes, not %zu", plan->size, copies[i].size);
+        }
+        bases[i] = copies[i].start;
+    }
+    apply_plan(plan, bases, slides, count);
+}
+
+void b_relocation_plan_free(struct data_reloc_plan *plan) {
+    if(!plan) return;
+    free(plan->fixups);
+    free(plan->segments);
+    free(plan);
+}
+
+struct lookup_one_by_one {
+    lookupsym_t lookup_sym;
+    void *context;
+};
+
+static void lookup_one_by_one(void *context, const char **names, addr_t *addrs, size_t count) {
+    struct lookup_one_by_one *ctx = context;
+    for(size_t i = 0; i < count; i++) {
+        addrs[i] = ctx->lookup_sym(ctx->context, names[i]);
+    }
+}
+
+void b_relocate(struct binary *load, const struct binary *target, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide) {
+    struct lookup_one_by_one ctx = {lookup_sym, context};
+    b_relocate_batch(load, target, mode, lookup_one_by_one, &ctx, slide);
+}
+
+void b_relocate_batch(struct binary *load, const struct binary *target, enum reloc_mode mode, lookupsyms_t lookup_syms, void *context, addr_t slide) {
+    if(mode == RELOC_USERLAND && slide != 0) {
+        die("sliding is not supported in userland mode");
+    }
 
     // check for overlap
     if(target) {
@@ -446,21 +1098,24 @@ void b_relocate(struct binary *load, const struct binary *target, enum reloc_mod
         }
     }
     
-    (load->mach->dyld_info ? relocate_with_dyld_info : relocate_with_symtab)(load, mode, lookup_sym, context, slide);
-    
-    if(mode != RELOC_EXTERN_ONLY && slide != 0) {
-        CMD_ITERATE(b_mach_hdr(load), cmd) {
-            MACHO_SPECIALIZE(
-                if(cmd->cmd == LC_SEGMENT_X) {
-                    segment_command_x *seg = (void *) cmd;
-                    section_x *sect = (void *) (seg + 1);
-                    seg->vmaddr += slide;
-                    for(uint32_t i = 0; i < seg->nsects; i++, sect++) {
-                        sect->addr += slide;
-                    }
-                }
-            )
-        }
-    }
+    struct data_reloc_plan *plan = make_plan(load, mode, lookup_syms, context, slide != 0, data_threads() > 1);
+    char *base = load->valid_range.start;
+    apply_plan(plan, &base, &slide, 1);
+    b_relocation_plan_free(plan);
+}
+
+bool b_try_relocate(struct binary *load, const struct binary *target, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide, struct data_status *status) {
+    return DATA_TRY(status, b_relocate(load, target, mode, lookup_sym, context, slide));
+}
+
+bool b_try_relocate_batch(struct binary *load, const struct binary *target, enum reloc_mode mode, lookupsyms_t lookup_syms, void *context, addr_t slide, struct data_status *status) {
+    return DATA_TRY(status, b_relocate_batch(load, target, mode, lookup_syms, context, slide));
+}
+
+bool b_try_relocation_plan_apply(const struct data_reloc_plan *plan, prange_t copy, addr_t slide, struct data_status *status) {
+    return DATA_TRY(status, b_relocation_plan_apply(plan, copy, slide));
 }
 
+bool b_try_relocation_plan_apply_many(const struct data_reloc_plan *plan, const prange_t *copies, const addr_t *slides, size_t count, struct data_status *status) {
+    return DATA_TRY(status, b_relocation_plan_apply_many(plan, copies, slides, count));
+}
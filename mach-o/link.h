@@ -2,6 +2,8 @@
 #include "binary.h"
 
 typedef addr_t (*lookupsym_t)(void *context, const char *sym);
+// looks up count symbols at once: sets addrs[i] to the address of names[i], or 0 if it can't be found
+typedef void (*lookupsyms_t)(void *context, const char **names, addr_t *addrs, size_t count);
 
 enum reloc_mode {
     RELOC_DEFAULT,
@@ -10,8 +12,29 @@ enum reloc_mode {
     RELOC_USERLAND
 };
 
+struct data_reloc_plan;
+
 __BEGIN_DECLS
 
 void b_relocate(struct binary *load, const struct binary *target /* can be null to not check for overlap */, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide);
+// if this fails, load may be partly relocated
+bool b_try_relocate(struct binary *load, const struct binary *target, enum reloc_mode mode, lookupsym_t lookup_sym, void *context, addr_t slide, struct data_status *status);
+// b_relocate collects the distinct symbols the binary needs first and only looks each one up once; this hands
+// them all to lookup_syms in a single call instead
+void b_relocate_batch(struct binary *load, const struct binary *target, enum reloc_mode mode, lookupsyms_t lookup_syms, void *context, addr_t slide);
+bool b_try_relocate_batch(struct binary *load, const struct binary *target, enum reloc_mode mode, lookupsyms_t lookup_syms, void *context, addr_t slide, struct data_status *status);
+
+// b_relocate without the relocating: works out everything it would write (looking up the symbols) and leaves
+// load alone.  the plan doesn't depend on the slide, so it can be applied to any number of copies of load's
+// valid_range (pdup) at different slides, without parsing anything again.  there's no overlap check.
+struct data_reloc_plan *b_relocation_plan(const struct binary *load, enum reloc_mode mode, lookupsyms_t lookup_syms, void *context);
+// does to copy what b_relocate would have done to load at this slide
+void b_relocation_plan_apply(const struct data_reloc_plan *plan, prange_t copy, addr_t slide);
+bool b_try_relocation_plan_apply(const struct data_reloc_plan *plan, prange_t copy, addr_t slide, struct data_status *status);
+// the same for count copies, each at its own slide (say, all the ones you're trying), going through the plan
+// once; with BR24 relocations, one copy failing stops the rest where they are too
+void b_relocation_plan_apply_many(const struct data_reloc_plan *plan, const prange_t *copies, const addr_t *slides, size_t count);
+bool b_try_relocation_plan_apply_many(const struct data_reloc_plan *plan, const prange_t *copies, const addr_t *slides, size_t count, struct data_status *status);
+void b_relocation_plan_free(struct data_reloc_plan *plan);
 
 __END_DECLS
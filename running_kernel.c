@@ -326,7 +326,7 @@ void b_running_kernel_load_macho(struct binary *binary) {
         }
     }
 
-    char *buf = malloc(maxoff);
+    char *buf = b_alloc(binary, maxoff);
 
     CMD_ITERATE(b_mach_hdr(binary), cmd) {
         if(cmd->cmd == LC_SEGMENT) {
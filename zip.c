@@ -0,0 +1,371 @@
+#include "zip.h"
+#include <zlib.h>
+
+#define ZIP_EOCD 0x06054b50
+#define ZIP64_EOCD_LOCATOR 0x07064b50
+#define ZIP64_EOCD 0x06064b50
+#define ZIP_CENTRAL 0x02014b50
+#define ZIP_LOCAL 0x04034b50
+
+static inline uint16_t get16(const uint8_t *p) {
+    return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+    return (uint32_t) get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+static inline uint64_t get64(const uint8_t *p) {
+    return (uint64_t) get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+static void pread_all(int fd, void *buf, size_t size, uint64_t offset) {
+    while(size) {
+        ssize_t got = pread(fd, buf, size, (off_t) offset);
+        if(got <= 0) {
+            edie("could not read zip (offset=%llx)", (unsigned long long) offset);
+        }
+        buf = (char *) buf + got;
+        size -= (size_t) got;
+        offset += (uint64_t) got;
+    }
+}
+
+// tail and cd are the caller's to free, so they don't leak if this dies
+static void read_directory(struct zip *zip, const char *filename, uint8_t **tailp, uint8_t **cdp) {
+#define _arg filename
+    off_t end = lseek(zip->fd, 0, SEEK_END);
+    if(end == -1) {
+        edie("could not seek");
+    }
+    if(end < 22) {
+        die("not a zip file (too small)");
+    }
+    zip->file_size = (uint64_t) end;
+
+    // the end of central directory record is 22 bytes plus a comment of up to 64K
+    size_t tail_size = (size_t) (zip->file_size < 0xffff + 22 ? zip->file_size : 0xffff + 22);
+    uint8_t *tail = *tailp = malloc(tail_size);
+    if(!tail) {
+        die("out of memory");
+    }
+    pread_all(zip->fd, tail, tail_size, zip->file_size - tail_size);
+    ssize_t i;
+    for(i = (ssize_t) tail_size - 22; i >= 0; i--) {
+        if(get32(tail + i) == ZIP_EOCD) break;
+    }
+    if(i < 0) {
+        die("not a zip file (no end of central directory)");
+    }
+    const uint8_t *eocd = tail + i;
+    uint64_t count = get16(eocd + 10), cd_size = get32(eocd + 12), cd_offset = get32(eocd + 16);
+    if(count == 0xffff || cd_size == 0xffffffff || cd_offset == 0xffffffff) {
+        // ZIP64: the real numbers are in another record, which the locator right before this one points to
+        uint64_t eocd_offset = zip->file_size - tail_size + (uint64_t) i;
+        uint8_t locator[20], record[56];
+        if(eocd_offset < sizeof(locator)) {
+            die("truncated ZIP64 locator");
+        }
+        pread_all(zip->fd, locator, sizeof(locator), eocd_offset - sizeof(locator));
+        if(get32(locator) != ZIP64_EOCD_LOCATOR) {
+            die("missing ZIP64 locator");
+        }
+        uint64_t record_offset = get64(locator + 8);
+        if(record_offset > zip->file_size - sizeof(record)) {
+            die("bad ZIP64 record offset");
+        }
+        pread_all(zip->fd, record, sizeof(record), record_offset);
+        if(get32(record) != ZIP64_EOCD) {
+            die("bad ZIP64 record");
+        }
+        count = get64(record + 32);
+        cd_size = get64(record + 40);
+        cd_offset = get64(record + 48);
+    }
+    if(cd_offset > zip->file_size || cd_size > zip->file_size - cd_offset || count > cd_size / 46) {
+        die("bad central directory (offset=%llx size=%llx count=%llu)", (unsigned long long) cd_offset, (unsigned long long) cd_size, (unsigned long long) count);
+    }
+
+    uint8_t *cd = *cdp = malloc((size_t) cd_size + 1);
+    zip->entries = malloc((size_t) count * sizeof(*zip->entries) + 1);
+    // the names are shorter than the entries they're in, so there's room for the NULs
+    char *names = zip->names = malloc((size_t) cd_size + 1);
+    if(!cd || !zip->entries || !names) {
+        die("out of memory");
+    }
+    pread_all(zip->fd, cd, (size_t) cd_size, cd_offset);
+    const uint8_t *p = cd, *cd_end = cd + cd_size;
+    for(uint32_t n = 0; n < count; n++) {
+        if(cd_end - p < 46 || get32(p) != ZIP_CENTRAL) {
+            die("bad central directory entry %u", n);
+        }
+        uint16_t name_len = get16(p + 28), extra_len = get16(p + 30), comment_len = get16(p + 32);
+        if(cd_end - p - 46 < name_len + extra_len + comment_len) {
+            die("truncated central directory entry %u", n);
+        }
+        struct zip_entry *entry = &zip->entries[n];
+        entry->flags = get16(p + 8);
+        entry->method = get16(p + 10);
+        entry->crc = get32(p + 16);
+        entry->compressed_size = get32(p + 20);
+        entry->size = get32(p + 24);
+        entry->offset = get32(p + 42);
+        entry->name = names;
+        memcpy(names, p + 46, name_len);
+        names += name_len;
+        *names++ = 0;
+
+        // the ZIP64 extra field has whichever of these didn't fit, in this order
+        const uint8_t *x = p + 46 + name_len, *x_end = x + extra_len;
+        while(x_end - x >= 4) {
+            uint16_t id = get16(x), size = get16(x + 2);
+            const uint8_t *q = x + 4, *q_end = q + size;
+            if(q_end > x_end) break;
+            if(id == 1) {
+                if(entry->size == 0xffffffff && q_end - q >= 8) {
+                    entry->size = get64(q);
+                    q += 8;
+                }
+                if(entry->compressed_size == 0xffffffff && q_end - q >= 8) {
+                    entry->compressed_size = get64(q);
+                    q += 8;
+                }
+                if(entry->offset == 0xffffffff && q_end - q >= 8) {
+                    entry->offset = get64(q);
+                }
+            }
+            x = q_end;
+        }
+        p += 46 + name_len + extra_len + comment_len;
+    }
+    zip->nentries = (uint32_t) count;
+#undef _arg
+}
+
+void zip_open(struct zip *zip, const char *filename) {
+#define _arg filename
+    memset(zip, 0, sizeof(*zip));
+    zip->fd = open(filename, O_RDONLY);
+    if(zip->fd == -1) {
+        edie("could not open");
+    }
+    uint8_t *tail = NULL, *cd = NULL;
+    struct data_status status;
+    bool ok = DATA_TRY(&status, read_directory(zip, filename, &tail, &cd));
+    free(tail);
+    free(cd);
+    if(!ok) {
+        zip_close(zip);
+        _die("%s\n", status.message);
+    }
+#undef _arg
+}
+
+void zip_close(struct zip *zip) {
+    close(zip->fd);
+    free(zip->entries);
+    free(zip->names);
+    memset(zip, 0, sizeof(*zip));
+}
+
+const struct zip_entry *zip_find(const struct zip *zip, const char *name) {
+    for(uint32_t i = 0; i < zip->nentries; i++) {
+        if(!strcmp(zip->entries[i].name, name)) {
+            return &zip->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// mmap wants a page-aligned offset, so map from the page before and hand back the middle (punmap copes)
+static prange_t map_member(const struct zip *zip, uint64_t offset, uint64_t size) {
+    uint64_t delta = offset & (uint64_t) (sysconf(_SC_PAGESIZE) - 1);
+    if(!size) {
+        return (prange_t) {NULL, 0};
+    }
+    if(size + delta > SIZE_MAX) {
+        die("member too big to map: %llx", (unsigned long long) size);
+    }
+    char *buf = mmap(NULL, (size_t) (size + delta), PROT_READ | PROT_WRITE, MAP_PRIVATE, zip->fd, (off_t) (offset - delta));
+    if(buf == MAP_FAILED) {
+        edie("could not mmap member");
+    }
+    return (prange_t) {buf + delta, (size_t) size};
+}
+
+// unmaps also before dying
+static void *map_anon(size_t size, prange_t also) {
+    void *buf = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0) : NULL;
+    if(buf == MAP_FAILED) {
+        int err = errno;
+        punmap(also);
+        errno = err;
+        edie("could not mmap %zu bytes", size);
+    }
+    return buf;
+}
+
+// zlib counts in uInts
+#define ZIP_CHUNK 0x40000000u
+
+static inline uInt zip_chunk(size_t left) {
+    return left < ZIP_CHUNK ? (uInt) left : ZIP_CHUNK;
+}
+
+static uint32_t member_crc(prange_t pr) {
+    uLong crc = crc32(0, NULL, 0);
+    for(size_t done = 0; done < pr.size; done += zip_chunk(pr.size - done)) {
+        crc = crc32(crc, (uint8_t *) pr.start + done, zip_chunk(pr.size - done));
+    }
+    return (uint32_t) crc;
+}
+
+// everything here that dies goes through zip_load, which may be under a DATA_TRY, so each step releases
+// what it has mapped (and the z_stream) before dying
+
+static void check_crc(const struct zip_entry *entry, prange_t pr) {
+#define _arg entry->name
+    uint32_t crc = member_crc(pr);
+    if(crc != entry->crc) {
+        punmap(pr);
+        die("bad CRC (%08x, expected %08x)", crc, entry->crc);
+    }
+#undef _arg
+}
+
+// stored: mapped straight out of the archive, unless the archive has it somewhere the parsers can't read
+// words from in place, in which case it gets copied somewhere that is aligned
+static prange_t load_stored_member(const struct zip *zip, const struct zip_entry *entry, uint64_t offset) {
+    prange_t pr = map_member(zip, offset, entry->size);
+    if((uintptr_t) pr.start & (sizeof(uint64_t) - 1)) {
+        void *copy = map_anon(pr.size, pr);
+        memcpy(copy, pr.start, pr.size);
+        punmap(pr);
+        pr.start = copy;
+    }
+    check_crc(entry, pr);
+    return pr;
+}
+
+static void inflate_all(const struct zip_entry *entry, z_stream *z, prange_t in, uint8_t *out, size_t size) {
+#define _arg entry->name
+    const uint8_t *in_next = in.start;
+    size_t in_left = in.size, out_done = 0;
+    int ret;
+    do {
+        if(!z->avail_in && in_left) {
+            z->next_in = (Bytef *) in_next;
+            z->avail_in = zip_chunk(in_left);
+            in_next += z->avail_in;
+            in_left -= z->avail_in;
+        }
+        if(!z->avail_out) {
+            z->next_out = out + out_done;
+            z->avail_out = zip_chunk(size - out_done);
+            out_done += z->avail_out;
+        }
+        uInt avail_in = z->avail_in, avail_out = z->avail_out;
+        ret = inflate(z, Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            die("inflate failed: %s", z->msg ? z->msg : "?");
+        }
+        if(ret != Z_STREAM_END && z->avail_in == avail_in && z->avail_out == avail_out) {
+            // no progress: out of input or out of room
+            die("inflate failed: member is %s than its header says", in_left || z->avail_in ? "bigger" : "smaller");
+        }
+    } while(ret != Z_STREAM_END);
+    if(z->avail_out || out_done != size) {
+        die("inflated to less than %zu bytes", size);
+    }
+#undef _arg
+}
+
+static prange_t inflate_member(const struct zip *zip, const struct zip_entry *entry, uint64_t offset) {
+#define _arg entry->name
+    if(entry->size > SIZE_MAX) {
+        die("member too big to inflate: %llx", (unsigned long long) entry->size);
+    }
+    prange_t out = {NULL, (size_t) entry->size};
+    prange_t in = map_member(zip, offset, entry->compressed_size);
+    prange_advise(in, ADVISE_SEQUENTIAL);
+    out.start = map_anon(out.size, in);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if(inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+        punmap(in);
+        punmap(out);
+        die("inflateInit2 failed");
+    }
+    struct data_status status;
+    bool ok = DATA_TRY(&status, inflate_all(entry, &z, in, out.start, out.size));
+    inflateEnd(&z);
+    punmap(in);
+    if(!ok) {
+        punmap(out);
+        _die("%s\n", status.message);
+    }
+
+    check_crc(entry, out);
+    return out;
+#undef _arg
+}
+
+prange_t zip_load(const struct zip *zip, const struct zip_entry *entry) {
+#define _arg entry->name
+    if(entry->flags & 1) {
+        die("encrypted members aren't supported");
+    }
+    uint8_t local[30];
+    if(entry->offset > zip->file_size - sizeof(local)) {
+        die("bad local header offset");
+    }
+    pread_all(zip->fd, local, sizeof(local), entry->offset);
+    if(get32(local) != ZIP_LOCAL) {
+        die("bad local header");
+    }
+    uint64_t offset = entry->offset + sizeof(local) + get16(local + 26) + get16(local + 28);
+    if(offset > zip->file_size || entry->compressed_size > zip->file_size - offset) {
+        die("truncated");
+    }
+    switch(entry->method) {
+    case 0:
+        if(entry->compressed_size != entry->size) {
+            die("stored member has different sizes");
+        }
+        return load_stored_member(zip, entry, offset);
+    case Z_DEFLATED:
+        return inflate_member(zip, entry, offset);
+    default:
+        die("unsupported compression method %u", entry->method);
+    }
+#undef _arg
+}
+
+static prange_t find_and_load(const struct zip *zip, const char *filename, const char *member) {
+#define _arg filename
+    const struct zip_entry *entry = zip_find(zip, member);
+    if(!entry) {
+        die("no member %s", member);
+    }
+    return zip_load(zip, entry);
+#undef _arg
+}
+
+// a function of its own so the result isn't a local that setjmp could clobber
+static bool try_find_and_load(const struct zip *zip, const char *filename, const char *member, prange_t *result, struct data_status *status) {
+    return DATA_TRY(status, *result = find_and_load(zip, filename, member));
+}
+
+prange_t load_zip_member(const char *filename, const char *member) {
+    struct zip zip;
+    zip_open(&zip, filename);
+    struct data_status status;
+    prange_t ret;
+    bool ok = try_find_and_load(&zip, filename, member, &ret, &status);
+    zip_close(&zip);
+    if(!ok) {
+        _die("%s\n", status.message);
+    }
+    return ret;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "common.h"
+
+// reading members of zip archives (like IPSWs) without extracting them to disk first
+
+struct zip_entry {
+    const char *name;
+    uint64_t offset; // of the local header
+    uint64_t compressed_size, size;
+    uint32_t crc;
+    uint16_t method, flags;
+};
+
+struct zip {
+    int fd;
+    uint64_t file_size;
+    struct zip_entry *entries;
+    uint32_t nentries;
+    char *names;
+};
+
+__BEGIN_DECLS
+
+// reads the central directory (ZIP64 included)
+void zip_open(struct zip *zip, const char *filename);
+void zip_close(struct zip *zip);
+// NULL if there's no such member
+const struct zip_entry *zip_find(const struct zip *zip, const char *name);
+// a stored member is mapped straight out of the archive (copy on write), or copied if it isn't 8-byte
+// aligned in it; a deflated one is inflated into anonymous memory.  either way its CRC is checked, it's
+// writable, and punmap it when you're done.
+prange_t zip_load(const struct zip *zip, const struct zip_entry *entry);
+// zip_open, zip_find, zip_load, zip_close
+prange_t load_zip_member(const char *filename, const char *member);
+
+__END_DECLS